@@ -0,0 +1,334 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libpiook.h"
+
+/*===========================================================
+Decoder core, shared by the daemon (piook.c) and the library (libpiook.c): the decoder config, pulse
+classification and frame checks, readings and their formatting, reject counters and the profiler hooks
+used by the pipeline stages (pipeline.h). Nothing here refers to the daemon's threads or globals.
+=============================================================*/
+
+/*====================
+Pulse durations in microseconds. These were determined by examining the signal transmitted by a
+ClimeMET CM7-TX, remote unit, transmitting on 433.92 MHz (temperature and humidity sensor).
+ClimeMET CM9088 (Master unit)
+These are the defaults; they can be overridden in the config file.
+======================*/
+const unsigned int __onMu = 1000;
+const unsigned int __offShortMu = 500;
+const unsigned int __offLongMu = 1500;
+
+// We probably need to allow for timing errors/jitter due to code runing on a non-realtime operating system.
+const unsigned int __jitterWindow = 250;
+
+// Limits of the jitter window when it is adapted to the measured jitter (adaptive_jitter). The upper limit keeps
+// the storm glitch filter (__stormGlitchFilterMu) below the shortest pulse window.
+const unsigned int __jitterMinMu = 100;
+const unsigned int __jitterMaxMu = 300;
+
+// Rolling statistics windows per sensor (see stats_windows).
+const int __maxStatWindows = 3;
+const unsigned int __maxStatWindowSec = 7 * 86400;
+
+// Alert rules (see the Alert rules section of piook.c). A rule compiles to a single predicate on one
+// value of a reading: raise when value * sign < raiseLimit (for holdNs), clear when value * sign >= clearLimit.
+const int __maxRules = 16;
+const int __sensorIdCount = 256;            // Sensor IDs are 8 bits.
+
+enum ruleField {
+    RULE_TEMP,
+    RULE_RH,
+    RULE_TEMP_MEAN,             // Rolling statistics (see stats_windows).
+    RULE_RH_MEAN,
+    RULE_TEMP_RATE,
+    RULE_RH_RATE,
+    RULE_STALE                  // No reading for holdNs; evaluated on the event loop tick.
+};
+
+struct alertRule {
+    char name[32];
+    int sensorId;               // -1 for every sensor.
+    int field;                  // ruleField.
+    unsigned int windowSec;     // Rolling statistics window of the _MEAN and _RATE fields.
+    int sign;                   // 1 for a lower limit (<, <=), -1 for an upper limit (>, >=).
+    int raiseLimit;             // Tenths (of a degree C, % RH, or per hour), multiplied by sign.
+    int clearLimit;             // As raiseLimit; greater for hysteresis.
+    uint64_t holdNs;            // The condition must hold this long before raising ('for', or the stale time).
+};
+
+const int __sinkQueueDefault = 16;          // Default output queue capacity (see sinkQueue in piook.h).
+
+// Decoder settings. Immutable once published; replaced as a whole on reload.
+struct decoderConfig {
+    unsigned int onMu;
+    unsigned int offShortMu;
+    unsigned int offLongMu;
+    unsigned int jitterWindow;
+    int adaptiveJitter;         // Adapt jitterWindow to the measured timing jitter, within the limits below.
+    unsigned int jitterMinMu, jitterMaxMu;
+
+    // Classification windows (exclusive bounds), derived from the above.
+    unsigned int onMuLower, onMuUpper;
+    unsigned int offShortMuLower, offShortMuUpper;
+    unsigned int offLongMuLower, offLongMuUpper;
+
+    unsigned int glitchFilterMu;
+    int foldNoise;              // Fold runs of noise edges into spans before queueing them (see noiseFolder).
+    int nearMiss;               // Log rejected frames to outfile.nearmiss (see nearMissHeader).
+    int quality;
+    int softDecode;
+    char outfilename[1024];     // Empty for stdout.
+    int outputFormat;           // See recordFormat.
+    int sinkPolicy;             // Output queue backpressure policy (see sinkPolicy).
+    int sinkQueueLen;           // Output queue capacity (readings).
+    int alertSinkPolicy;        // As sinkPolicy and sinkQueueLen, for the alert sink.
+    int alertSinkQueueLen;
+    int aggregateSinkPolicy;    // And for the aggregation sink.
+    int aggregateSinkQueueLen;
+    int statWindowCount;        // Rolling statistics windows (0 for none).
+    unsigned int statWindowSec[__maxStatWindows];
+    unsigned int aggregateIntervalSec;      // Aggregation sink interval (0 for none).
+    int aggregateDeadband;                  // Aggregation sink deadband, in tenths (0 for none).
+    int ruleCount;              // Alert rules.
+    alertRule rules[__maxRules];
+    uint16_t sensorRules[__sensorIdCount];  // Reading rules that apply to each sensor ID (a bit per rule).
+    uint16_t staleRules;                    // Stale rules (a bit per rule).
+};
+
+void setDefaultConfig(decoderConfig* c);
+void setTimingWindows(decoderConfig* c);
+const char* configError(const decoderConfig* c);
+
+// Pulse buffer sizes.
+const int __maxBits = 128;
+const int __noiseHistory = 64;
+const unsigned int __noiseLookbackMu = 50000;
+
+int decodePulse(const decoderConfig* c, int highLow, unsigned int duration);
+int scanForPreamble(const int* bits, int count);
+void bitsToBytes(const int* bits, int byteCount, uint8_t* data);
+
+// Per-frame signal quality figures (durations in microseconds).
+struct frameQuality {
+    int meanDevMu;      // Mean deviation of the frame's pulses from their nominal widths.
+    int maxDevMu;       // Max deviation of any pulse from its nominal width.
+    int minMarginMu;    // Smallest distance from any pulse duration to the edge of its classification window.
+    int noiseBefore;    // Noise edges seen shortly before the frame.
+    int softBits;       // Bits recovered by soft decoding.
+};
+
+// A candidate frame as passed from a protocol decoder to the validator (see pipeline.h).
+struct frameBits {
+    const int* bits;                // Pulse codes (1 or 2), from the start of the preamble.
+    const unsigned int* onDur;      // Duration of the 'on' pulse preceding each bit.
+    const unsigned int* offDur;     // Duration of each bit's 'off' pulse.
+    int count;
+    int noiseBefore;                // Noise edges seen shortly before the frame.
+    uint64_t frameEndNs;            // Capture time of the edge that completed the frame.
+};
+
+// A decoded reading.
+const int __maxFrameBytes = 8;
+
+// Rolling statistics of a sensor over one window, as published with each reading.
+struct rollingValue {
+    int min, max, mean;         // Tenths (of a degree C, or of a % RH).
+    int ratePerHour;            // Change from the first to the last reading in the window, in tenths per hour.
+};
+
+struct rollingWindowStats {
+    unsigned int windowSec;
+    int count;                  // Readings in the window.
+    rollingValue temp, rh;
+};
+
+struct rollingSummary {
+    int windowCount;
+    rollingWindowStats windows[__maxStatWindows];
+};
+
+struct reading {
+    int protocol;                   // PIOOK_PROTOCOL_*.
+    int sensorId;
+    int tempInt;                    // Tenths of a degree C.
+    int rh;
+    frameQuality quality;
+    uint64_t frameEndNs;            // Capture time of the edge that completed the frame; readings are timed by it.
+    uint64_t validatedNs;           // For the frame-to-validated latency only.
+    uint8_t raw[__maxFrameBytes];   // The frame's bytes, checksum included.
+    int rawLen;
+    rollingSummary rolling;         // Filled in by the daemon's readingSink.
+    int alert;                      // For the alert sink: 1 raised, 0 cleared (see alertRule), else -1.
+    char alertName[32];
+    int64_t unixNs;                 // For the alert and aggregate sinks: when the alert was raised or cleared, or the
+                                    // time of the aggregate's last reading (see captureUnixNs()).
+};
+
+int pulseMargin(const decoderConfig* c, int code, unsigned int duration);
+int pulseDeviation(const decoderConfig* c, int code, unsigned int duration);
+void measureFrameQuality(const decoderConfig* c, const frameBits& f, frameQuality* q);
+int softCorrectFrame(const decoderConfig* c, const frameBits& f, uint8_t* data);
+uint64_t packQuality(const frameQuality* q);
+
+// Output record formats. FORMAT_AUTO is CSV to a file and text to stdout.
+enum recordFormat {
+    FORMAT_AUTO,
+    FORMAT_CSV,             // 21.10,50[,meanDev,maxDev,minMargin,noise,softBits]
+    FORMAT_TEXT,            // Temp: 21.10, RH: 50[, MeanDev: 3us, ...]
+    FORMAT_JSON,            // {"sensor":82,"temp":21.1,"rh":50,"time_ms":...[,"mean_dev_us":3,...]}
+    FORMAT_INFLUX,          // piook,sensor=82 temp=21.1,rh=50i[,mean_dev_us=3i,...] <unix ns>
+    FORMAT_BINARY,          // piook_record (see libpiook.h).
+    FORMAT_COUNT
+};
+
+const int __maxRecordLen = 1024;
+extern const char* __recordFormatNames[FORMAT_COUNT];
+int parseRecordFormat(const char* name);
+int formatRecord(char* buf, int format, int sensorId, int tempInt, int rh, const frameQuality* q, const rollingSummary* rs, int64_t unixNs);
+const int __maxAlertLen = 160;
+int formatAlert(char* buf, uint64_t unixSec, int raised, const char* name, int sensorId, int tempInt, int rh);
+void encodeRecord(piook_record* out, const reading& r, const frameQuality* q, int flags, uint64_t unixNs);
+void printHex(uint8_t* buf, int len);
+uint64_t packFrame(const uint8_t* data);
+uint8_t crc8( uint8_t *addr, uint8_t len);
+
+// USDT static tracepoints (provider 'piook'). When <sys/sdt.h> is available (Debian/Raspbian package
+// systemtap-sdt-dev) each probe compiles to a single nop plus an ELF note, and is only activated when a
+// tracer such as perf or bpftrace attaches; otherwise the probes compile to nothing at all.
+// Define PIOOK_NO_SDT to disable the probes explicitly.
+#if !defined(PIOOK_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PIOOK_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef PIOOK_HAVE_SDT
+#define PIOOK_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(piook, name, a1, a2, a3)
+#define PIOOK_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(piook, name, a1, a2, a3, a4)
+#else
+#define PIOOK_PROBE3(name, a1, a2, a3) do {} while(0)
+#define PIOOK_PROBE4(name, a1, a2, a3, a4) do {} while(0)
+#endif
+
+// Reject/drop counters. One statBlock per thread, summed on demand.
+enum statId {
+    STAT_EDGES,
+    STAT_NOISE_ON,
+    STAT_NOISE_OFF,
+    STAT_OFF_WITHOUT_ON,
+    STAT_ON_FOLLOWED_BY_ON,
+    STAT_BUFFER_OVERFLOW,
+    STAT_NO_PREAMBLE,
+    STAT_BAD_LENGTH,
+    STAT_BAD_CRC,
+    STAT_FRAMES_OK,
+    STAT_RING_OVERFLOW,
+    STAT_SOFT_RECOVERED,
+    STAT_GLITCH_FILTERED,
+    STAT_NOISE_FOLDED,
+    STAT_NEAR_MISS_LOGGED,
+    STAT_NEAR_MISS_DROPPED,
+    STAT_COUNT
+};
+
+struct statBlock {
+    uint64_t counts[STAT_COUNT];
+} __attribute__((aligned(64)));
+
+extern const char* __statNames[STAT_COUNT];
+
+// Increment a counter in a block owned by the caller (e.g. a pipeline stage's). Single writer per block,
+// so a relaxed load/store pair suffices (no locked RMW on the hot path).
+inline void statInc(statBlock* b, statId id)
+{
+    __atomic_store_n(&b->counts[id], b->counts[id] + 1, __ATOMIC_RELAXED);
+}
+
+inline void statAdd(statBlock* b, statId id, uint64_t n)
+{
+    __atomic_store_n(&b->counts[id], b->counts[id] + n, __ATOMIC_RELAXED);
+}
+
+// An edge as queued by the interrupt handler for the decoder thread.
+// A noise span (see noiseFolder) stands for a run of edges that each ended a noise pulse; it has the
+// times and level of the last of them, the total duration of their pulses, and their number.
+struct edgeEvent {
+    uint64_t captureNs;     // CLOCK_MONOTONIC time at capture.
+    unsigned int timeMu;    // wiringPi micros() at capture.
+    int highLow;            // Pin level after the edge.
+    unsigned int spanMu;    // Noise span duration.
+    unsigned int spanEdges; // Edges in the noise span; 0 for a plain edge.
+};
+
+const unsigned int __maxSpanEdges = 1024;
+
+// A batch of edges in structure of arrays form, so that the pulses can be classified with SIMD.
+const int __edgeBatchSize = 256;            // Multiple of 32 (the widest classification kernel).
+
+struct edgeBatch {
+    uint64_t captureNs[__edgeBatchSize];
+    uint32_t timeMu[__edgeBatchSize];
+    uint32_t duration[__edgeBatchSize];     // Duration of the pulse ending at each edge (set by the classifier).
+    uint8_t level[__edgeBatchSize];         // Pin level after each edge (0 or 1).
+    uint8_t codes[__edgeBatchSize / 4 + 8]; // Pulse codes, 2 bits each, 4 per byte (first pulse in the low bits);
+                                            // padded so that a 64 bit word can be read from any pulse.
+    int count;
+};
+
+void classifyPulseBatch(const decoderConfig* c, const uint32_t* duration, const uint8_t* level, int n, uint8_t* codes);
+void classifyPulseBatchScalar(const decoderConfig* c, const uint32_t* duration, const uint8_t* level, int n, uint8_t* codes);
+const char* classifyPulseBatchKernel();
+
+inline int batchCode(const uint8_t* codes, int i)
+{
+    return (codes[i >> 2] >> ((i & 3) * 2)) & 3;
+}
+
+// CLOCK_MONOTONIC time; edge capture times and frame times are on this clock.
+uint64_t monotonicNs();
+
+// Self-profiler pipeline stages. PROF_IDLE marks time that is not attributed to any stage.
+enum profStage {
+    PROF_CAPTURE,
+    PROF_CLASSIFY,
+    PROF_PREAMBLE,
+    PROF_FRAME_BUILD,
+    PROF_CRC,
+    PROF_PARSE,
+    PROF_FORMAT,
+    PROF_SINK,
+    PROF_COUNT,
+    PROF_IDLE = PROF_COUNT
+};
+
+extern int _profile;
+extern uint64_t _profNs[PROF_COUNT];
+extern __thread int _tlsProfStage;
+extern __thread uint64_t _tlsProfLastNs;
+
+// Attribute the time since this thread's previous stage boundary to the stage being left, and enter the given stage.
+inline void profSwitchAt(profStage stage, uint64_t nowNs)
+{
+    if(!_profile) {
+        return;
+    }
+    int prev = _tlsProfStage;
+    if(PROF_IDLE != prev && 0 != _tlsProfLastNs) {
+        __atomic_store_n(&_profNs[prev], _profNs[prev] + (nowNs - _tlsProfLastNs), __ATOMIC_RELAXED);
+    }
+    _tlsProfStage = stage;
+    _tlsProfLastNs = nowNs;
+}
+
+inline void profSwitch(profStage stage)
+{
+    if(_profile) {
+        profSwitchAt(stage, monotonicNs());
+    }
+}
+
+#endif
@@ -0,0 +1,1111 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <endian.h>
+#include <new>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "decoder.h"
+#include "pipeline.h"
+
+/*===========================================================
+Decoder core, shared by the piook daemon and the libpiook embedding API (below).
+Nothing here does I/O or keeps per-decoder state in globals; the decoder state lives in the
+pipeline stages (see pipeline.h). The only globals are the stage profiler's, which is off unless
+the host switches it on (piook --profile).
+=============================================================*/
+int _profile = 0;
+uint64_t _profNs[PROF_COUNT];
+__thread int _tlsProfStage = PROF_IDLE;
+__thread uint64_t _tlsProfLastNs = 0;
+
+uint64_t monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char* __statNames[STAT_COUNT] = {
+    "edges",
+    "noise_on",
+    "noise_off",
+    "off_without_on",
+    "on_followed_by_on",
+    "buffer_overflow",
+    "no_preamble",
+    "bad_length",
+    "bad_crc",
+    "frames_ok",
+    "ring_overflow",
+    "soft_recovered",
+    "glitch_filtered",
+    "noise_folded",
+    "near_miss_logged",
+    "near_miss_dropped"
+};
+
+void setDefaultConfig(decoderConfig* c)
+{
+    memset(c, 0, sizeof(*c));
+    c->onMu = __onMu;
+    c->offShortMu = __offShortMu;
+    c->offLongMu = __offLongMu;
+    c->jitterWindow = __jitterWindow;
+    c->jitterMinMu = __jitterMinMu;
+    c->jitterMaxMu = __jitterMaxMu;
+    c->sinkQueueLen = __sinkQueueDefault;
+}
+
+// Derive the classification windows from the nominal pulse durations and the jitter window.
+void setTimingWindows(decoderConfig* c)
+{
+    c->onMuUpper = c->onMu + c->jitterWindow;
+    c->onMuLower = c->onMu - c->jitterWindow;
+    c->offShortMuUpper = c->offShortMu + c->jitterWindow;
+    c->offShortMuLower = c->offShortMu - c->jitterWindow;
+    c->offLongMuUpper = c->offLongMu + c->jitterWindow;
+    c->offLongMuLower = c->offLongMu - c->jitterWindow;
+}
+
+// Description of the problem with a config's timing settings, or NULL if they are valid.
+const char* configError(const decoderConfig* c)
+{
+    if(0 == c->onMu || 0 == c->offShortMu || 0 == c->offLongMu) {
+        return "pulse durations must be nonzero";
+    }
+    if(c->jitterWindow >= c->onMu || c->jitterWindow >= c->offShortMu || c->offShortMuUpper > c->offLongMuLower ||
+        c->onMuUpper < c->onMu || c->offLongMuUpper < c->offLongMu) {
+        return "jitter window is too wide for the pulse durations";
+    }
+    if(c->glitchFilterMu >= c->offShortMuLower) {
+        return "glitch filter would filter out valid pulses";
+    }
+    return NULL;
+}
+
+/*===========================================================
+We record received 'pulses'; there are three kinds of pulse:
+1 - short 'off' pulse. Represents a binary 1.
+2 - long 'off' pulse. Represents a binary 0.
+3 - 'on' pulse. 
+0 - Represents a 'noise' pulse.
+The decoding stages themselves are in pipeline.h; these are the functions they are built on.
+=============================================================*/
+
+// The pulse classification windows are taken from the decoder config (see setTimingWindows()),
+// which defaults to the pulse durations defined in decoder.h.
+int decodePulse(const decoderConfig* c, int highLow, unsigned int duration)
+{
+    if(0 == highLow)
+    {
+        // Test for short 'off' pulse.
+        if(duration > c->offShortMuLower && duration < c->offShortMuUpper) {
+            return 1;
+        }
+        else if(duration > c->offLongMuLower && duration < c->offLongMuUpper) {
+            return 2;
+        }
+        return 0;
+    }
+
+    // Test for 'on' pulse.
+    if(duration > c->onMuLower && duration < c->onMuUpper) {
+        return 3;
+    }
+
+    // Noise.
+    return 0;
+}
+
+// Distance (micros) from a classified pulse's duration to the nearest edge of its classification window.
+int pulseMargin(const decoderConfig* c, int code, unsigned int duration)
+{
+    unsigned int lower, upper;
+    switch(code)
+    {
+        case 1: lower = c->offShortMuLower; upper = c->offShortMuUpper; break;
+        case 2: lower = c->offLongMuLower; upper = c->offLongMuUpper; break;
+        default: lower = c->onMuLower; upper = c->onMuUpper; break;
+    }
+    unsigned int a = duration - lower;
+    unsigned int b = upper - duration;
+    return a < b ? a : b;
+}
+
+// Deviation (micros) of a classified pulse's duration from the nominal duration for that pulse type.
+int pulseDeviation(const decoderConfig* c, int code, unsigned int duration)
+{
+    int nominal = (1 == code) ? c->offShortMu : (2 == code) ? c->offLongMu : c->onMu;
+    int dev = (int)duration - nominal;
+    return dev < 0 ? -dev : dev;
+}
+
+// Compute signal quality figures for the pulses of a candidate frame. As pulseDeviation() and pulseMargin()
+// for each pulse, but without branching on the pulse code (a frame's bits are all 1 or 2), so that the loop
+// can be vectorised. Every pulse of a frame was classified into its window, and the windows are centred on
+// the nominal durations (see setTimingWindows()), so a pulse's margin is the jitter window less its
+// deviation, and the smallest margin is that of the largest deviation.
+void measureFrameQuality(const decoderConfig* c, const frameBits& f, frameQuality* q)
+{
+    const int onMu = c->onMu, offShortMu = c->offShortMu, offLongMu = c->offLongMu;
+
+    unsigned int devSum = 0;
+    int maxDev = 0;
+    for(int i=0; i<f.count; i++)
+    {
+        int offMu = 1 == f.bits[i] ? offShortMu : offLongMu;
+        int onDev = (int)f.onDur[i] - onMu;
+        int offDev = (int)f.offDur[i] - offMu;
+        onDev = onDev < 0 ? -onDev : onDev;
+        offDev = offDev < 0 ? -offDev : offDev;
+        devSum += onDev + offDev;
+        int dev = onDev > offDev ? onDev : offDev;
+        maxDev = dev > maxDev ? dev : maxDev;
+    }
+
+    int pulseCount = 2 * f.count;
+    q->meanDevMu = pulseCount > 0 ? (devSum + pulseCount / 2) / pulseCount : 0;
+    q->maxDevMu = maxDev;
+    q->minMarginMu = (int)c->jitterWindow - maxDev;
+    q->noiseBefore = f.noiseBefore;
+    q->softBits = 0;
+}
+
+// Soft decoding: flip the data bit whose 'off' pulse was closest to the edge of its classification
+// window (i.e. the least confident bit) and re-test the checksum. Returns 1 if that recovered the frame.
+int softCorrectFrame(const decoderConfig* c, const frameBits& f, uint8_t* data)
+{
+    int worstBit = 0;
+    int worstMargin = c->jitterWindow + 1;
+    for(int i=0; i<40; i++)
+    {
+        int idx = 4 + i;    // Data follows the first 4 bits of the preamble.
+        int margin = pulseMargin(c, f.bits[idx], f.offDur[idx]);
+        if(margin < worstMargin)
+        {
+            worstMargin = margin;
+            worstBit = i;
+        }
+    }
+
+    data[worstBit / 8] ^= 0x80 >> (worstBit % 8);
+    if(crc8(data, 4) == data[4]) {
+        return 1;
+    }
+
+    // Restore.
+    data[worstBit / 8] ^= 0x80 >> (worstBit % 8);
+    return 0;
+}
+
+// Scan the buffered pulses for the fixed preamble sequence.
+int scanForPreamble(const int* bits, int count)
+{
+    static int preambleSeq[8] = {1, 1, 1, 1, 2, 1, 2, 2};
+
+    for(int i=0; i<count-8; i++)
+    {
+        int j=0;
+        for(; j<8 && bits[j+i] == preambleSeq[j]; j++);
+                
+        if(8==j) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Convert pulse codes into a byte array, msb first.
+void bitsToBytes(const int* bits, int byteCount, uint8_t* data)
+{
+    for(int i=0; i<byteCount; i++, bits += 8)
+    {
+        unsigned int b = 0;
+        for(int j=0; j<8; j++) {
+            b = (b << 1) | (1 == bits[j]);
+        }
+        data[i] = (uint8_t)b;
+    }
+}
+
+
+/*===========================================================
+Batch pulse classification.
+Classifies a batch of pulses (durations and pin levels in separate arrays) with the same windows
+and result as decodePulse(), packing the codes 2 bits per pulse. The kernel is chosen at compile
+time: AVX2 (8 pulses per compare), SSE2 or NEON (4 per compare), else the scalar reference. All
+of them produce the same output bit for bit. Each SIMD kernel builds 4 code bytes per 32 bit word
+and packs a word's 4 codes into one byte, with shifts in the vector registers (x86) or a multiply
+(NEON; code n moves to bits 24+2n); the bytes are in little endian order, as on every target piook
+runs on.
+=============================================================*/
+// Scalar reference.
+void classifyPulseBatchScalar(const decoderConfig* c, const uint32_t* duration, const uint8_t* level, int n, uint8_t* codes)
+{
+    for(int i=0; i<n; i+=4)
+    {
+        uint8_t packed = 0;
+        for(int j=0; j<4 && i+j<n; j++) {
+            packed |= decodePulse(c, level[i+j], duration[i+j]) << (j * 2);
+        }
+        codes[i >> 2] = packed;
+    }
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+// x86 only has signed 32 bit compares; flipping the top bit of both sides gives the unsigned ordering.
+const uint32_t __signFlip = 0x80000000u;
+
+#if defined(__AVX2__)
+#define KERNEL_NAME "avx2"
+#define KERNEL_WIDTH 8
+typedef __m256i vec;
+static inline vec vecSet(uint32_t v) { return _mm256_set1_epi32((int)v); }
+static inline vec vecLoad(const uint32_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline vec vecLoadLevels(const uint8_t* p) { return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)); }
+static inline vec vecAnd(vec a, vec b) { return _mm256_and_si256(a, b); }
+static inline vec vecAndNot(vec a, vec b) { return _mm256_andnot_si256(a, b); }    // ~a & b
+static inline vec vecOr(vec a, vec b) { return _mm256_or_si256(a, b); }
+static inline vec vecXor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+static inline vec vecEq(vec a, vec b) { return _mm256_cmpeq_epi32(a, b); }
+static inline vec vecGt(vec a, vec b) { return _mm256_cmpgt_epi32(a, b); }
+#else
+#define KERNEL_NAME "sse2"
+#define KERNEL_WIDTH 4
+typedef __m128i vec;
+static inline vec vecSet(uint32_t v) { return _mm_set1_epi32((int)v); }
+static inline vec vecLoad(const uint32_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline vec vecLoadLevels(const uint8_t* p)
+{
+    uint32_t l;
+    memcpy(&l, p, sizeof(l));
+    __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)l), zero), zero);
+}
+static inline vec vecAnd(vec a, vec b) { return _mm_and_si128(a, b); }
+static inline vec vecAndNot(vec a, vec b) { return _mm_andnot_si128(a, b); }        // ~a & b
+static inline vec vecOr(vec a, vec b) { return _mm_or_si128(a, b); }
+static inline vec vecXor(vec a, vec b) { return _mm_xor_si128(a, b); }
+static inline vec vecEq(vec a, vec b) { return _mm_cmpeq_epi32(a, b); }
+static inline vec vecGt(vec a, vec b) { return _mm_cmpgt_epi32(a, b); }
+#endif
+
+// Classification windows, sign flipped for signed compares.
+struct batchWindows {
+    vec onLower, onUpper;
+    vec shortLower, shortUpper;
+    vec longLower, longUpper;
+};
+
+static inline vec inWindow(vec d, vec lower, vec upper)
+{
+    return vecAnd(vecGt(d, lower), vecGt(upper, d));
+}
+
+// Codes for KERNEL_WIDTH pulses, one per 32 bit lane.
+static inline vec classifyLanes(const batchWindows& w, const uint32_t* duration, const uint8_t* level)
+{
+    vec d = vecXor(vecLoad(duration), vecSet(__signFlip));
+    vec low = vecEq(vecLoadLevels(level), vecSet(0));
+    vec offCode = vecOr(vecAnd(inWindow(d, w.shortLower, w.shortUpper), vecSet(1)),
+                        vecAnd(inWindow(d, w.longLower, w.longUpper), vecSet(2)));
+    vec onCode = vecAnd(inWindow(d, w.onLower, w.onUpper), vecSet(3));
+    return vecOr(vecAnd(low, offCode), vecAndNot(low, onCode));
+}
+
+// Narrow 4 vectors of codes to bytes, in pulse order, pack each 32 bit word's 4 codes into its low
+// byte (code n moves to bits 2n) and store the KERNEL_WIDTH packed bytes.
+static inline void narrowCodes(vec c0, vec c1, vec c2, vec c3, uint8_t* codes)
+{
+#if defined(__AVX2__)
+    // The packs work within each 128 bit half; the permute restores the pulse order.
+    __m256i b = _mm256_packus_epi16(_mm256_packs_epi32(c0, c1), _mm256_packs_epi32(c2, c3));
+    b = _mm256_permutevar8x32_epi32(b, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    b = _mm256_or_si256(_mm256_or_si256(b, _mm256_srli_epi32(b, 6)), _mm256_or_si256(_mm256_srli_epi32(b, 12), _mm256_srli_epi32(b, 18)));
+    b = _mm256_and_si256(b, _mm256_set1_epi32(0xFF));
+    b = _mm256_packus_epi16(_mm256_packs_epi32(b, b), b);
+    uint32_t lo = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(b));
+    uint32_t hi = (uint32_t)_mm_cvtsi128_si32(_mm256_extracti128_si256(b, 1));
+    memcpy(codes, &lo, sizeof(lo));
+    memcpy(codes + 4, &hi, sizeof(hi));
+#else
+    __m128i b = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+    b = _mm_or_si128(_mm_or_si128(b, _mm_srli_epi32(b, 6)), _mm_or_si128(_mm_srli_epi32(b, 12), _mm_srli_epi32(b, 18)));
+    b = _mm_and_si128(b, _mm_set1_epi32(0xFF));
+    b = _mm_packus_epi16(_mm_packs_epi32(b, b), b);
+    uint32_t packed = (uint32_t)_mm_cvtsi128_si32(b);
+    memcpy(codes, &packed, sizeof(packed));
+#endif
+}
+
+void classifyPulseBatch(const decoderConfig* c, const uint32_t* duration, const uint8_t* level, int n, uint8_t* codes)
+{
+    batchWindows w;
+    w.onLower = vecSet(c->onMuLower ^ __signFlip);
+    w.onUpper = vecSet(c->onMuUpper ^ __signFlip);
+    w.shortLower = vecSet(c->offShortMuLower ^ __signFlip);
+    w.shortUpper = vecSet(c->offShortMuUpper ^ __signFlip);
+    w.longLower = vecSet(c->offLongMuLower ^ __signFlip);
+    w.longUpper = vecSet(c->offLongMuUpper ^ __signFlip);
+
+    const int block = 4 * KERNEL_WIDTH;
+    int i = 0;
+    for(; i + block <= n; i += block)
+    {
+        narrowCodes(classifyLanes(w, duration + i, level + i),
+                    classifyLanes(w, duration + i + KERNEL_WIDTH, level + i + KERNEL_WIDTH),
+                    classifyLanes(w, duration + i + 2 * KERNEL_WIDTH, level + i + 2 * KERNEL_WIDTH),
+                    classifyLanes(w, duration + i + 3 * KERNEL_WIDTH, level + i + 3 * KERNEL_WIDTH),
+                    codes + (i >> 2));
+    }
+    classifyPulseBatchScalar(c, duration + i, level + i, n - i, codes + (i >> 2));
+}
+
+#elif defined(__ARM_NEON)
+#define KERNEL_NAME "neon"
+
+const uint32_t __codePackMul = (1u << 24) | (1u << 18) | (1u << 12) | (1u << 6);
+
+static inline uint32x4_t inWindow(uint32x4_t d, uint32x4_t lower, uint32x4_t upper)
+{
+    return vandq_u32(vcgtq_u32(d, lower), vcltq_u32(d, upper));
+}
+
+void classifyPulseBatch(const decoderConfig* c, const uint32_t* duration, const uint8_t* level, int n, uint8_t* codes)
+{
+    uint32x4_t onLower = vdupq_n_u32(c->onMuLower), onUpper = vdupq_n_u32(c->onMuUpper);
+    uint32x4_t shortLower = vdupq_n_u32(c->offShortMuLower), shortUpper = vdupq_n_u32(c->offShortMuUpper);
+    uint32x4_t longLower = vdupq_n_u32(c->offLongMuLower), longUpper = vdupq_n_u32(c->offLongMuUpper);
+    uint32x4_t one = vdupq_n_u32(1), two = vdupq_n_u32(2), three = vdupq_n_u32(3);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        uint8x16_t levels = vld1q_u8(level + i);
+        uint16x8_t levelsLo = vmovl_u8(vget_low_u8(levels));
+        uint16x8_t levelsHi = vmovl_u8(vget_high_u8(levels));
+        uint32x4_t l[4] = { vmovl_u16(vget_low_u16(levelsLo)), vmovl_u16(vget_high_u16(levelsLo)),
+                            vmovl_u16(vget_low_u16(levelsHi)), vmovl_u16(vget_high_u16(levelsHi)) };
+        uint32x4_t code[4];
+        for(int j=0; j<4; j++)
+        {
+            uint32x4_t d = vld1q_u32(duration + i + j * 4);
+            uint32x4_t low = vceqq_u32(l[j], vdupq_n_u32(0));
+            uint32x4_t offCode = vorrq_u32(vandq_u32(inWindow(d, shortLower, shortUpper), one),
+                                           vandq_u32(inWindow(d, longLower, longUpper), two));
+            uint32x4_t onCode = vandq_u32(inWindow(d, onLower, onUpper), three);
+            code[j] = vorrq_u32(vandq_u32(low, offCode), vbicq_u32(onCode, low));
+        }
+
+        uint8x16_t bytes = vcombine_u8(vmovn_u16(vcombine_u16(vmovn_u32(code[0]), vmovn_u32(code[1]))),
+                                       vmovn_u16(vcombine_u16(vmovn_u32(code[2]), vmovn_u32(code[3]))));
+        uint32x4_t packed = vshrq_n_u32(vmulq_u32(vreinterpretq_u32_u8(bytes), vdupq_n_u32(__codePackMul)), 24);
+        uint32_t words[4];
+        vst1q_u32(words, packed);
+        for(int j=0; j<4; j++) {
+            codes[(i >> 2) + j] = (uint8_t)words[j];
+        }
+    }
+    classifyPulseBatchScalar(c, duration + i, level + i, n - i, codes + (i >> 2));
+}
+
+#else
+#define KERNEL_NAME "scalar"
+
+void classifyPulseBatch(const decoderConfig* c, const uint32_t* duration, const uint8_t* level, int n, uint8_t* codes)
+{
+    classifyPulseBatchScalar(c, duration, level, n, codes);
+}
+#endif
+
+// Name of the classification kernel compiled in.
+const char* classifyPulseBatchKernel()
+{
+    return KERNEL_NAME;
+}
+
+// Pack the quality figures into one integer for tracing; 16 bits each for mean deviation, max deviation and
+// min margin, 8 bits each for noise edges and soft bits.
+uint64_t packQuality(const frameQuality* q)
+{
+    return ((uint64_t)(q->meanDevMu & 0xFFFF) << 48) | ((uint64_t)(q->maxDevMu & 0xFFFF) << 32)
+        | ((uint64_t)(q->minMarginMu & 0xFFFF) << 16) | ((q->noiseBefore > 255 ? 255 : q->noiseBefore) << 8) | (q->softBits & 0xFF);
+}
+
+// Pack the five frame bytes into one integer so that a tracer receives the whole frame as a single probe argument.
+uint64_t packFrame(const uint8_t* data)
+{
+    uint64_t v = 0;
+    for(int i=0; i<5; i++) {
+        v = (v << 8) | data[i];
+    }
+    return v;
+}
+
+/*
+* Function taken from Luc Small (http://lucsmall.com), itself
+* derived from the OneWire Arduino library. Modifications to
+* the polynomial according to Fine Offset's CRC8 calulations.
+* Since reworked to take a nibble at a time from a table, rather than a bit at a time.
+*/
+static const uint8_t __crc8Nibbles[16] = {
+    0x00, 0x31, 0x62, 0x53, 0xc4, 0xf5, 0xa6, 0x97, 0xb9, 0x88, 0xdb, 0xea, 0x7d, 0x4c, 0x1f, 0x2e
+};
+
+uint8_t crc8(uint8_t *addr, uint8_t len)
+{
+    uint8_t crc = 0;
+
+    // Polynomial 0x31, msb first (the reference OneWire CRC-8 is 0x8C, lsb first); the table holds
+    // the CRC of each nibble shifted through it.
+    while (len--) {
+        crc ^= *addr++;
+        crc = (uint8_t)(crc << 4) ^ __crc8Nibbles[crc >> 4];
+        crc = (uint8_t)(crc << 4) ^ __crc8Nibbles[crc >> 4];
+    }
+    return crc;
+}
+
+/*===========================================================
+Record formatting.
+Readings are formatted with integer arithmetic only, straight into the caller's buffer: the
+temperature is already fixed point (tenths of a degree), so there is no need for float
+formatting, locale handling or stdio. The CSV and text formats match the original printf
+output ("%3.2f", i.e. always two decimals) exactly.
+=============================================================*/
+const char* __recordFormatNames[FORMAT_COUNT] = { "auto", "csv", "text", "json", "influx", "binary" };
+
+int parseRecordFormat(const char* name)
+{
+    for(int i=0; i<FORMAT_COUNT; i++)
+    {
+        if(0 == strcmp(name, __recordFormatNames[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline char* putStr(char* p, const char* s)
+{
+    while(*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static inline char* putUint(char* p, uint32_t v)
+{
+    char digits[10];
+    int n = 0;
+    do
+    {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    }
+    while(0 != v);
+    while(n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static inline char* putInt(char* p, int v)
+{
+    if(v < 0)
+    {
+        *p++ = '-';
+        return putUint(p, 0u - (uint32_t)v);
+    }
+    return putUint(p, (uint32_t)v);
+}
+
+// 64 bit values (timestamps) as two 32 bit halves, avoiding a 64 bit divide per digit on 32 bit ARM.
+static inline char* putUint64(char* p, uint64_t v)
+{
+    if(v <= 0xFFFFFFFFu) {
+        return putUint(p, (uint32_t)v);
+    }
+    const uint32_t e9 = 1000000000u;
+    uint64_t high = v / e9;
+    uint32_t low = (uint32_t)(v - high * e9);
+    p = putUint64(p, high);
+    char digits[9];
+    for(int i=8; i>=0; i--)
+    {
+        digits[i] = (char)('0' + low % 10);
+        low /= 10;
+    }
+    for(int i=0; i<9; i++) {
+        *p++ = digits[i];
+    }
+    return p;
+}
+
+// Fixed point tenths, e.g. -57 as "-5.7" (or "-5.70" with a trailing zero).
+static inline char* putTenths(char* p, int tenths, int trailingZero)
+{
+    uint32_t a = (uint32_t)tenths;
+    if(tenths < 0)
+    {
+        *p++ = '-';
+        a = 0u - a;
+    }
+    p = putUint(p, a / 10);
+    *p++ = '.';
+    *p++ = (char)('0' + a % 10);
+    if(trailingZero) {
+        *p++ = '0';
+    }
+    return p;
+}
+
+// Rolling statistics fields, appended in the style of the format.
+static char* putRollingValue(char* p, int format, const char* name, unsigned int windowSec, const char* field, int v)
+{
+    switch(format)
+    {
+        case FORMAT_JSON:
+            *p++ = '"';
+            p = putStr(p, name);
+            *p++ = '_';
+            p = putStr(p, field);
+            p = putStr(p, "\":");
+            break;
+        case FORMAT_INFLUX:
+            p = putStr(p, name);
+            *p++ = '_';
+            p = putStr(p, field);
+            *p++ = '_';
+            p = putUint(p, windowSec);
+            p = putStr(p, "s=");
+            break;
+        case FORMAT_TEXT:
+            *p++ = ' ';
+            p = putStr(p, field);
+            *p++ = ' ';
+            break;
+        default:
+            break;
+    }
+    return putTenths(p, v, 0);
+}
+
+static char* putRolling(char* p, int format, const rollingSummary* rs)
+{
+    for(int i=0; i<rs->windowCount; i++)
+    {
+        const rollingWindowStats* w = &rs->windows[i];
+        int text = FORMAT_TEXT == format;
+        const char* names[2] = { text ? "Temp" : "temp", text ? "RH" : "rh" };
+        const rollingValue* values[2] = { &w->temp, &w->rh };
+        if(FORMAT_JSON == format)
+        {
+            p = putStr(p, ",\"w");
+            p = putUint(p, w->windowSec);
+            p = putStr(p, "s\":{\"count\":");
+            p = putInt(p, w->count);
+        }
+        else if(FORMAT_TEXT == format)
+        {
+            p = putStr(p, ", ");
+            p = putUint(p, w->windowSec);
+            p = putStr(p, "s (");
+            p = putInt(p, w->count);
+            *p++ = ')';
+        }
+        for(int j=0; j<2; j++)
+        {
+            if(text)
+            {
+                p = putStr(p, j ? ", " : " ");
+                p = putStr(p, names[j]);
+                *p++ = ':';
+            }
+            const char* fields[4] = { "min", "max", "mean", text ? "rate/h" : "rate_h" };
+            int v[4] = { values[j]->min, values[j]->max, values[j]->mean, values[j]->ratePerHour };
+            for(int k=0; k<4; k++)
+            {
+                if(!text) {
+                    *p++ = ',';
+                }
+                p = putRollingValue(p, format, names[j], w->windowSec, fields[k], v[k]);
+            }
+        }
+        if(FORMAT_JSON == format) {
+            *p++ = '}';
+        }
+    }
+    return p;
+}
+
+// Format a reading as one newline terminated record. buf must have room for __maxRecordLen chars (or
+// PIOOK_MAX_RECORD_LEN without rolling statistics); the quality figures and rolling statistics are optional
+// (NULL for none). Returns the record length.
+int formatRecord(char* buf, int format, int sensorId, int tempInt, int rh, const frameQuality* q, const rollingSummary* rs, int64_t unixNs)
+{
+    char* p = buf;
+    switch(format)
+    {
+        case FORMAT_JSON:
+            p = putStr(p, "{\"sensor\":");
+            p = putInt(p, sensorId);
+            p = putStr(p, ",\"temp\":");
+            p = putTenths(p, tempInt, 0);
+            p = putStr(p, ",\"rh\":");
+            p = putInt(p, rh);
+            p = putStr(p, ",\"time_ms\":");
+            p = putUint64(p, (uint64_t)unixNs / 1000000);
+            if(NULL != q)
+            {
+                p = putStr(p, ",\"mean_dev_us\":");
+                p = putInt(p, q->meanDevMu);
+                p = putStr(p, ",\"max_dev_us\":");
+                p = putInt(p, q->maxDevMu);
+                p = putStr(p, ",\"min_margin_us\":");
+                p = putInt(p, q->minMarginMu);
+                p = putStr(p, ",\"noise\":");
+                p = putInt(p, q->noiseBefore);
+                p = putStr(p, ",\"soft_bits\":");
+                p = putInt(p, q->softBits);
+            }
+            if(NULL != rs) {
+                p = putRolling(p, format, rs);
+            }
+            *p++ = '}';
+            break;
+
+        case FORMAT_INFLUX:
+            p = putStr(p, "piook,sensor=");
+            p = putInt(p, sensorId);
+            p = putStr(p, " temp=");
+            p = putTenths(p, tempInt, 0);
+            p = putStr(p, ",rh=");
+            p = putInt(p, rh);
+            *p++ = 'i';
+            if(NULL != q)
+            {
+                p = putStr(p, ",mean_dev_us=");
+                p = putInt(p, q->meanDevMu);
+                p = putStr(p, "i,max_dev_us=");
+                p = putInt(p, q->maxDevMu);
+                p = putStr(p, "i,min_margin_us=");
+                p = putInt(p, q->minMarginMu);
+                p = putStr(p, "i,noise=");
+                p = putInt(p, q->noiseBefore);
+                p = putStr(p, "i,soft_bits=");
+                p = putInt(p, q->softBits);
+                *p++ = 'i';
+            }
+            if(NULL != rs) {
+                p = putRolling(p, format, rs);
+            }
+            *p++ = ' ';
+            p = putUint64(p, (uint64_t)unixNs);
+            break;
+
+        case FORMAT_TEXT:
+            p = putStr(p, "Temp: ");
+            p = putTenths(p, tempInt, 1);
+            p = putStr(p, ", RH: ");
+            p = putInt(p, rh);
+            if(NULL != q)
+            {
+                p = putStr(p, ", MeanDev: ");
+                p = putInt(p, q->meanDevMu);
+                p = putStr(p, "us, MaxDev: ");
+                p = putInt(p, q->maxDevMu);
+                p = putStr(p, "us, MinMargin: ");
+                p = putInt(p, q->minMarginMu);
+                p = putStr(p, "us, Noise: ");
+                p = putInt(p, q->noiseBefore);
+                p = putStr(p, ", SoftBits: ");
+                p = putInt(p, q->softBits);
+            }
+            if(NULL != rs) {
+                p = putRolling(p, format, rs);
+            }
+            break;
+
+        default:
+            p = putTenths(p, tempInt, 1);
+            *p++ = ',';
+            p = putInt(p, rh);
+            if(NULL != q)
+            {
+                *p++ = ',';
+                p = putInt(p, q->meanDevMu);
+                *p++ = ',';
+                p = putInt(p, q->maxDevMu);
+                *p++ = ',';
+                p = putInt(p, q->minMarginMu);
+                *p++ = ',';
+                p = putInt(p, q->noiseBefore);
+                *p++ = ',';
+                p = putInt(p, q->softBits);
+            }
+            if(NULL != rs) {
+                p = putRolling(p, format, rs);
+            }
+            break;
+    }
+    *p++ = '\n';
+    return (int)(p - buf);
+}
+
+// Format an alert as one newline terminated line, e.g. "1792274833 raised frost sensor=82 temp=-0.5 rh=80", with
+// the same integer formatting as formatRecord(). buf must have room for __maxAlertLen chars. Returns the line length.
+int formatAlert(char* buf, uint64_t unixSec, int raised, const char* name, int sensorId, int tempInt, int rh)
+{
+    char* p = buf;
+    p = putUint64(p, unixSec);
+    p = putStr(p, raised ? " raised " : " cleared ");
+    p = putStr(p, name);
+    p = putStr(p, " sensor=");
+    p = putInt(p, sensorId);
+    p = putStr(p, " temp=");
+    p = putTenths(p, tempInt, 0);
+    p = putStr(p, " rh=");
+    p = putInt(p, rh);
+    *p++ = '\n';
+    return (int)(p - buf);
+}
+
+static_assert(64 == sizeof(piook_record), "piook_record layout changed");
+static_assert(PIOOK_READING_V1_SIZE == offsetof(piook_reading, protocol), "piook_reading ABI version 1 layout changed");
+
+static inline int16_t saturate16(int v)
+{
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+}
+
+// Encode a reading as a binary record (see libpiook.h); quality is optional (NULL for none).
+void encodeRecord(piook_record* out, const reading& r, const frameQuality* q, int flags, uint64_t unixNs)
+{
+    memset(out, 0, sizeof(*out));
+    out->magic = htole32(PIOOK_RECORD_MAGIC);
+    out->version = htole16(PIOOK_RECORD_VERSION);
+    out->size = htole16(sizeof(piook_record));
+    out->time_ns = htole64(unixNs);
+    out->frame_end_ns = htole64(r.frameEndNs);
+    out->protocol = htole16(r.protocol);
+    out->sensor_id = htole16(r.sensorId);
+    out->temp_tenths = (int16_t)htole16((uint16_t)r.tempInt);
+    out->rh = (uint8_t)r.rh;
+    if(NULL != q)
+    {
+        flags |= PIOOK_RECORD_QUALITY;
+        out->soft_bits = (uint8_t)(q->softBits > 255 ? 255 : q->softBits);
+        out->mean_dev_us = (int16_t)htole16((uint16_t)saturate16(q->meanDevMu));
+        out->max_dev_us = (int16_t)htole16((uint16_t)saturate16(q->maxDevMu));
+        out->min_margin_us = (int16_t)htole16((uint16_t)saturate16(q->minMarginMu));
+        out->noise_before = htole16(q->noiseBefore > UINT16_MAX ? UINT16_MAX : q->noiseBefore);
+    }
+    out->flags = htole16(flags);
+    int rawLen = r.rawLen < (int)sizeof(out->raw) ? r.rawLen : (int)sizeof(out->raw);
+    out->raw_len = (uint8_t)rawLen;
+    memcpy(out->raw, r.raw, rawLen);
+}
+
+/*===========================================================
+libpiook embedding API (see libpiook.h).
+A context is a decoder config, a statBlock and a pipeline ending in an apiSink, which hands each
+reading to the output array of the current call if there is one, else to the callback. Everything
+a context needs is allocated by piook_create().
+=============================================================*/
+
+// Terminal stage for library contexts.
+struct apiSink {
+    piook_reading_fn fn;
+    void* user;
+    unsigned char* out;         // Output array of the current piook_push_edges_sized() call, else NULL.
+    size_t stride;              // The host's sizeof(piook_reading).
+    size_t cap;                 // Its capacity.
+    size_t count;               // Readings delivered in the current call.
+    piook_reading held[__maxProtocols];     // Readings that did not fit in out[] (an edge can complete a
+    int heldCount;                          // frame for each protocol decoder), for the next call.
+
+    apiSink() : fn(NULL), user(NULL), out(NULL), stride(0), cap(0), count(0), heldCount(0) {}
+
+    // Write a reading to out[], as much of it as the host's struct has room for.
+    void store(const piook_reading& pr)
+    {
+        memcpy(out + count * stride, &pr, stride < sizeof(pr) ? stride : sizeof(pr));
+    }
+
+    void onReading(const reading& r)
+    {
+        piook_reading pr;
+        pr.sensor_id = r.sensorId;
+        pr.temp_tenths = r.tempInt;
+        pr.rh = r.rh;
+        pr.soft_bits = r.quality.softBits;
+        pr.mean_dev_us = r.quality.meanDevMu;
+        pr.max_dev_us = r.quality.maxDevMu;
+        pr.min_margin_us = r.quality.minMarginMu;
+        pr.noise_before = r.quality.noiseBefore;
+        pr.frame_end_ns = r.frameEndNs;
+        pr.protocol = r.protocol;
+        pr.raw_len = r.rawLen;
+        memcpy(pr.raw, r.raw, sizeof(pr.raw));
+
+        if(NULL != out)
+        {
+            if(count == cap)
+            {   // The caller stops at this edge.
+                held[heldCount++] = pr;
+                return;
+            }
+            store(pr);
+        }
+        else if(NULL != fn) {
+            fn(user, &pr);
+        }
+        count++;
+    }
+
+    // Deliver the readings held over from a piook_push_edges_sized() call, to out[] (as space allows) or the callback.
+    void deliverHeld()
+    {
+        int i = 0;
+        for(; i<heldCount && (NULL == out || count < cap); i++)
+        {
+            if(NULL != out) {
+                store(held[i]);
+            }
+            else if(NULL != fn) {
+                fn(user, &held[i]);
+            }
+            count++;
+        }
+        heldCount -= i;
+        memmove(held, held + i, heldCount * sizeof(held[0]));
+    }
+
+    void onRejectedFrame(const frameBits&, int, const uint8_t*, int) {}
+    void setConfig(const decoderConfig*) {}
+    void setStats(statBlock*) {}
+    bool idle() const { return true; }
+    void flush(uint64_t) {}
+};
+
+typedef glitchFilter<pulseClassifier<protocolBank<frameValidator<frameParser<apiSink> > > > > apiPipeline;
+
+struct piook_ctx {
+    decoderConfig config;
+    statBlock stats;
+    apiPipeline pipeline;
+    edgeBatch batch;
+};
+
+static apiSink& ctxSink(piook_ctx* ctx)
+{
+    return ctx->pipeline.next.next.next.next.next;
+}
+
+// Build a decoder config from API settings. Returns a description of the problem if they are invalid.
+static const char* settingsToConfig(const piook_settings* s, decoderConfig* c)
+{
+    setDefaultConfig(c);
+    if(NULL != s)
+    {
+        if(s->size < sizeof(piook_settings)) {
+            return "settings size is too small (initialise with piook_default_settings())";
+        }
+        c->onMu = s->on_us;
+        c->offShortMu = s->off_short_us;
+        c->offLongMu = s->off_long_us;
+        c->jitterWindow = s->jitter_us;
+        c->glitchFilterMu = s->glitch_filter_us;
+        c->softDecode = s->soft_decode;
+    }
+    setTimingWindows(c);
+    return configError(c);
+}
+
+static inline void decodeApiEdge(piook_ctx* ctx, const piook_edge& edge)
+{
+    statInc(&ctx->stats, STAT_EDGES);
+    edgeEvent e;
+    e.captureNs = edge.time_ns;
+    e.timeMu = (unsigned int)(edge.time_ns / 1000);     // Wraps, as micros() does; only differences are used.
+    e.highLow = 0 != edge.level;
+    e.spanMu = 0;
+    e.spanEdges = 0;
+    ctx->pipeline.onEdge(e);
+}
+
+extern "C" {
+
+int piook_abi_version(void)
+{
+    return PIOOK_ABI_VERSION;
+}
+
+void piook_default_settings(piook_settings* s)
+{
+    memset(s, 0, sizeof(*s));
+    s->size = sizeof(*s);
+    s->on_us = __onMu;
+    s->off_short_us = __offShortMu;
+    s->off_long_us = __offLongMu;
+    s->jitter_us = __jitterWindow;
+}
+
+const char* piook_settings_error(const piook_settings* settings)
+{
+    decoderConfig c;
+    return settingsToConfig(settings, &c);
+}
+
+piook_ctx* piook_create(const piook_settings* settings, piook_reading_fn fn, void* user)
+{
+    piook_ctx* ctx = new (std::nothrow) piook_ctx;
+    if(NULL == ctx) {
+        return NULL;
+    }
+    if(NULL != settingsToConfig(settings, &ctx->config))
+    {
+        delete ctx;
+        return NULL;
+    }
+
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->pipeline.next.next.spawn<cm7Decoder>();
+    ctx->pipeline.next.next.next.stampFrames = false;      // Nothing here reads validatedNs.
+    ctx->pipeline.setConfig(&ctx->config);
+    ctx->pipeline.setStats(&ctx->stats);
+    ctx->pipeline.setMinMu(ctx->config.glitchFilterMu);
+    ctxSink(ctx).fn = fn;
+    ctxSink(ctx).user = user;
+    return ctx;
+}
+
+void piook_destroy(piook_ctx* ctx)
+{
+    delete ctx;
+}
+
+// Edges are transposed into structure of arrays batches and classified a batch at a time.
+size_t piook_push_edges(piook_ctx* ctx, const piook_edge* edges, size_t n)
+{
+    apiSink& sink = ctxSink(ctx);
+    sink.count = 0;
+    sink.deliverHeld();
+    edgeBatch& b = ctx->batch;
+    for(size_t i=0; i<n; )
+    {
+        size_t count = n - i < (size_t)__edgeBatchSize ? n - i : __edgeBatchSize;
+        for(size_t j=0; j<count; j++, i++)
+        {
+            b.captureNs[j] = edges[i].time_ns;
+            b.timeMu[j] = (uint32_t)(edges[i].time_ns / 1000);
+            b.level[j] = 0 != edges[i].level;
+        }
+        b.count = (int)count;
+        __atomic_store_n(&ctx->stats.counts[STAT_EDGES], ctx->stats.counts[STAT_EDGES] + count, __ATOMIC_RELAXED);
+        ctx->pipeline.onEdgeBatch(b);
+    }
+    return sink.count;
+}
+
+size_t piook_push_edges_sized(piook_ctx* ctx, const piook_edge* edges, size_t n, void* out, size_t reading_size, size_t cap, size_t* consumed)
+{
+    if(reading_size < (size_t)PIOOK_READING_V1_SIZE)
+    {
+        if(NULL != consumed) {
+            *consumed = 0;
+        }
+        return 0;
+    }
+    apiSink& sink = ctxSink(ctx);
+    sink.out = (unsigned char*)out;
+    sink.stride = reading_size;
+    sink.cap = cap;
+    sink.count = 0;
+    sink.deliverHeld();
+    size_t i = 0;
+    for(; i<n && sink.count < cap && 0 == sink.heldCount; i++) {
+        decodeApiEdge(ctx, edges[i]);
+    }
+    sink.out = NULL;
+
+    if(NULL != consumed) {
+        *consumed = i;
+    }
+    return sink.count;
+}
+
+size_t piook_push_edges_into(piook_ctx* ctx, const piook_edge* edges, size_t n, piook_reading* out, size_t cap, size_t* consumed)
+{
+    return piook_push_edges_sized(ctx, edges, n, out, PIOOK_READING_V1_SIZE, cap, consumed);
+}
+
+size_t piook_flush(piook_ctx* ctx, uint64_t now_ns)
+{
+    apiSink& sink = ctxSink(ctx);
+    sink.count = 0;
+    sink.deliverHeld();
+    ctx->pipeline.flush(now_ns);
+    return sink.count;
+}
+
+size_t piook_format_reading(const piook_reading* r, int format, int with_quality, int64_t unix_ns, char* buf, size_t len)
+{
+    if(len < (size_t)PIOOK_MAX_RECORD_LEN || format < PIOOK_FORMAT_CSV || format > PIOOK_FORMAT_INFLUX) {
+        return 0;
+    }
+    frameQuality q;
+    q.meanDevMu = r->mean_dev_us;
+    q.maxDevMu = r->max_dev_us;
+    q.minMarginMu = r->min_margin_us;
+    q.noiseBefore = r->noise_before;
+    q.softBits = r->soft_bits;
+    return (size_t)formatRecord(buf, format, r->sensor_id, r->temp_tenths, r->rh, with_quality ? &q : NULL, NULL, unix_ns);
+}
+
+void piook_encode_record(const piook_reading* pr, uint64_t unix_ns, piook_record* out)
+{
+    reading r;
+    r.protocol = pr->protocol;
+    r.sensorId = pr->sensor_id;
+    r.tempInt = pr->temp_tenths;
+    r.rh = pr->rh;
+    r.quality.meanDevMu = pr->mean_dev_us;
+    r.quality.maxDevMu = pr->max_dev_us;
+    r.quality.minMarginMu = pr->min_margin_us;
+    r.quality.noiseBefore = pr->noise_before;
+    r.quality.softBits = pr->soft_bits;
+    r.frameEndNs = pr->frame_end_ns;
+    r.validatedNs = 0;
+    r.rawLen = pr->raw_len < sizeof(r.raw) ? (int)pr->raw_len : (int)sizeof(r.raw);
+    r.rolling.windowCount = 0;
+    r.alert = -1;
+    memcpy(r.raw, pr->raw, r.rawLen);
+    encodeRecord(out, r, &r.quality, 0, unix_ns);
+}
+
+int piook_counter_count(void)
+{
+    return STAT_COUNT;
+}
+
+const char* piook_counter_name(int id)
+{
+    return id >= 0 && id < STAT_COUNT ? __statNames[id] : NULL;
+}
+
+uint64_t piook_counter(const piook_ctx* ctx, int id)
+{
+    return id >= 0 && id < STAT_COUNT ? ctx->stats.counts[id] : 0;
+}
+
+}
@@ -0,0 +1,160 @@
+
+#ifndef LIBPIOOK_H
+#define LIBPIOOK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*===========================================================
+libpiook - embeddable CM7-TX on-off keying decoder.
+Feed it edges (pin level transitions with their capture times) in batches and it returns the decoded
+readings through a callback or an output array. The library does no I/O, creates no threads and keeps
+no decoder state in globals; each piook_ctx is an independent decoder. A context must only be used by one thread at a
+time, but any number of contexts can be used concurrently. No memory is allocated after piook_create().
+
+The ABI is plain C; the structs below only ever grow at the end, and the host tells the library which
+fields it knows about: piook_settings carries its own size, and arrays of piook_reading are passed with
+the host's sizeof(piook_reading) (see piook_push_edges_sized()).
+=============================================================*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PIOOK_ABI_VERSION 2
+
+typedef struct piook_ctx piook_ctx;
+
+// An edge; the pin level after a transition and the time it was captured.
+typedef struct piook_edge {
+    uint64_t time_ns;           // Capture time (any monotonic clock; must not go backwards).
+    int32_t level;              // Pin level after the edge (0 or 1).
+    uint32_t reserved;
+} piook_edge;
+
+// A decoded reading. Fields up to frame_end_ns are those of ABI version 1.
+typedef struct piook_reading {
+    int32_t sensor_id;
+    int32_t temp_tenths;        // Temperature in tenths of a degree C.
+    int32_t rh;                 // Relative humidity (%).
+    int32_t soft_bits;          // Bits recovered by soft decoding (0 or 1).
+    int32_t mean_dev_us;        // Mean deviation of the frame's pulses from their nominal widths.
+    int32_t max_dev_us;         // Max deviation of any pulse from its nominal width.
+    int32_t min_margin_us;      // Smallest distance from any pulse duration to the edge of its timing window.
+    int32_t noise_before;       // Noise edges seen shortly before the frame.
+    uint64_t frame_end_ns;      // time_ns of the edge that completed the frame.
+    uint32_t protocol;          // PIOOK_PROTOCOL_* (ABI version 2 onwards).
+    uint32_t raw_len;           // Frame bytes in raw[] (checksum included).
+    uint8_t raw[8];
+} piook_reading;
+
+// Decoder settings; initialise with piook_default_settings().
+typedef struct piook_settings {
+    uint32_t size;              // sizeof(piook_settings).
+    uint32_t on_us;             // Nominal pulse durations.
+    uint32_t off_short_us;
+    uint32_t off_long_us;
+    uint32_t jitter_us;         // Allowed deviation from the nominal durations.
+    uint32_t glitch_filter_us;  // Drop edges closer than this to the previous edge (0 = off).
+    int32_t soft_decode;        // Recover frames with a single bad bit.
+} piook_settings;
+
+typedef void (*piook_reading_fn)(void* user, const piook_reading* r);
+
+int piook_abi_version(void);
+void piook_default_settings(piook_settings* s);
+
+// Create a decoder. settings may be NULL for the defaults, fn may be NULL if only piook_push_edges_sized() is used.
+// Returns NULL if the settings are invalid (see piook_settings_error()) or on allocation failure.
+piook_ctx* piook_create(const piook_settings* settings, piook_reading_fn fn, void* user);
+void piook_destroy(piook_ctx* ctx);
+
+// Description of the problem with the given settings, or NULL if they are valid.
+const char* piook_settings_error(const piook_settings* settings);
+
+// Decode a batch of edges, passing each reading to the context's callback. Returns the number of readings.
+// This is the fast path; pulses are classified many at a time with SIMD where available.
+size_t piook_push_edges(piook_ctx* ctx, const piook_edge* edges, size_t n);
+
+// Decode a batch of edges into out[], an array of cap readings of reading_size bytes each; pass
+// sizeof(piook_reading). Fields beyond reading_size are not written, so a host built against an older header
+// gets the fields it knows about. Stops early if out[] fills up; *consumed (if not NULL) receives the number
+// of edges processed, and the remaining edges should be pushed again. Returns the number of readings written
+// (0, with no edges consumed, if reading_size is smaller than PIOOK_READING_V1_SIZE).
+// An edge can complete more than one reading (one per protocol decoder); if they do not all fit, the edge is
+// still consumed and the rest are held over, to be returned first by the next call (or piook_push_edges() or
+// piook_flush(), through the callback).
+#define PIOOK_READING_V1_SIZE 40
+size_t piook_push_edges_sized(piook_ctx* ctx, const piook_edge* edges, size_t n, void* out, size_t reading_size, size_t cap, size_t* consumed);
+
+// As piook_push_edges_sized() with ABI version 1 readings (PIOOK_READING_V1_SIZE bytes each, up to frame_end_ns);
+// kept for hosts built against that version.
+size_t piook_push_edges_into(piook_ctx* ctx, const piook_edge* edges, size_t n, piook_reading* out, size_t cap, size_t* consumed);
+
+// Decode the frame in progress, if any (e.g. at the end of a recording, or when the host shuts down); a frame
+// is otherwise decoded on the noise that follows it. Readings go to the callback. Returns the number of readings.
+size_t piook_flush(piook_ctx* ctx, uint64_t now_ns);
+
+// Record formats for piook_format_reading().
+#define PIOOK_FORMAT_CSV 1          // 21.10,50
+#define PIOOK_FORMAT_TEXT 2         // Temp: 21.10, RH: 50
+#define PIOOK_FORMAT_JSON 3         // {"sensor":82,"temp":21.1,"rh":50,"time_ms":1700000000000}
+#define PIOOK_FORMAT_INFLUX 4       // piook,sensor=82 temp=21.1,rh=50i 1700000000000000000
+#define PIOOK_MAX_RECORD_LEN 256
+
+// Format a reading as a newline terminated record (not nul terminated) using integer arithmetic only. unix_ns is the
+// reading's wall clock time (used by JSON and Influx). buf must hold PIOOK_MAX_RECORD_LEN chars. Returns the record
+// length, or 0 if the format is unknown or buf is too small.
+size_t piook_format_reading(const piook_reading* r, int format, int with_quality, int64_t unix_ns, char* buf, size_t len);
+
+/*===========================================================
+Binary reading record.
+A fixed-size (64 byte), versioned record for consumers that map readings directly rather than parse text
+(piook --format binary, and the library's piook_encode_record()). Every field is naturally aligned and
+stored little endian, so on little endian hosts (including the Raspberry Pi) a record can be used in place.
+Fields are only ever added in the reserved space or at the end (with a larger size); consumers should check
+magic and version, and use size to step over records.
+=============================================================*/
+#define PIOOK_RECORD_MAGIC 0x4B4F4950u      // "PIOK" in little endian byte order.
+#define PIOOK_RECORD_VERSION 1
+
+#define PIOOK_PROTOCOL_CM7 1                // ClimeMET CM7-TX.
+
+#define PIOOK_RECORD_QUALITY 0x0001         // The signal quality fields are valid.
+#define PIOOK_RECORD_RESTORED 0x0002        // Republished from a saved state rather than received.
+
+typedef struct piook_record {
+    uint32_t magic;             // PIOOK_RECORD_MAGIC.
+    uint16_t version;           // PIOOK_RECORD_VERSION.
+    uint16_t size;              // sizeof(piook_record).
+    uint64_t time_ns;           // Wall clock (Unix) time the record was written.
+    uint64_t frame_end_ns;      // Monotonic capture time of the edge that completed the frame.
+    uint16_t protocol;          // PIOOK_PROTOCOL_*.
+    uint16_t flags;             // PIOOK_RECORD_*.
+    uint16_t sensor_id;
+    int16_t temp_tenths;        // Temperature in tenths of a degree C.
+    uint8_t rh;                 // Relative humidity (%).
+    uint8_t raw_len;            // Frame bytes in raw[].
+    uint8_t soft_bits;          // Signal quality (see piook_reading); saturated to the field width.
+    uint8_t reserved0;
+    int16_t mean_dev_us;
+    int16_t max_dev_us;
+    int16_t min_margin_us;
+    uint16_t noise_before;
+    uint8_t raw[16];            // The frame's bytes, as received.
+    uint32_t reserved1;
+} piook_record;
+
+// Encode a reading as a binary record; unix_ns is the wall clock time to record.
+void piook_encode_record(const piook_reading* r, uint64_t unix_ns, piook_record* out);
+
+// Decoder counters (edges, rejects by reason, frames decoded).
+int piook_counter_count(void);
+const char* piook_counter_name(int id);
+uint64_t piook_counter(const piook_ctx* ctx, int id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,22 +1,175 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <wiringPi.h>
 #include "piook.h"
+#include "pipeline.h"
 
 // GPIO Pin to monitor.
 int _pinNum = 7;
-char* _outfilename;
+
+// The daemon's sink; notes the frame's pulse deviation (adaptive_jitter), records the sensor as heard, updates
+// its rolling statistics, evaluates the alert rules for the sensor, adds the reading to its aggregate (if
+// enabled), and queues the reading (with the statistics) for the output's sink thread. Rejected frames go
+// to the near-miss log (near_miss).
+struct readingSink {
+    const decoderConfig* cfg;
+
+    readingSink() : cfg(NULL) {}
+
+    void onReading(const reading& r)
+    {
+        histRecord(HIST_FRAME_TO_VALIDATED, r.validatedNs - r.frameEndNs);
+        if(cfg->adaptiveJitter) {
+            noteFrameDeviation(r.quality.maxDevMu);
+        }
+        reading out = r;
+        int sensor = noteSensorHeard(r.sensorId, r.tempInt, r.rh, r.frameEndNs);
+        if(-1 != sensor)
+        {
+            updateRollingStats(sensor, cfg, r, &out.rolling);
+            evaluateRules(cfg, sensor, out);
+            if(0 != cfg->aggregateIntervalSec || 0 != cfg->aggregateDeadband) {
+                aggregateReading(cfg, sensor, r);
+            }
+        }
+        sinkEnqueue(&_outputSink, out, cfg->sinkPolicy, cfg->sinkQueueLen);
+    }
+
+    void onRejectedFrame(const frameBits& f, int reason, const uint8_t* data, int dataLen)
+    {
+        if(cfg->nearMiss) {
+            logNearMiss(cfg, f, reason, data, dataLen);
+        }
+    }
+
+    void setConfig(const decoderConfig* c)
+    {
+        if(NULL != cfg && rulesChanged(cfg, c)) {
+            resetReadingRules();
+        }
+        cfg = c;
+    }
+    void setStats(statBlock*) {}
+    bool idle() const { return true; }
+    void flush(uint64_t) {}
+};
+
+// Pushes edges onto the capture ring for the decoder thread (see captureEdge()).
+struct edgeRingWriter {
+    void onEdge(const edgeEvent& e) { pushEdge(e); }
+    void onEdgeBatch(edgeBatch& b) { pushEdges(b); }
+    void setConfig(const decoderConfig*) {}
+    void setStats(statBlock*) {}
+    bool idle() const { return true; }
+    void flush(uint64_t) {}
+};
+
+// The daemon's pipelines.
+typedef glitchFilter<noiseFolder<edgeRingWriter> > capturePipeline;
+typedef pulseClassifier<protocolBank<frameValidator<frameParser<readingSink> > > > decodePipeline;
+
+// The capture side (interrupt or polling thread) and decoder thread pipelines (see pipeline.h).
+capturePipeline _capture;
+decodePipeline _decoder;
+
+// Self-profiling (--profile); reports the share of time spent in each pipeline stage.
+const int __profileIntervalSec = 10;
+
+/*===========================================================
+Allocation free hot path.
+Nothing on the capture -> decode -> publish path allocates; buffers are fixed size and static,
+sized at compile/start time (edge ring, bit and timing buffers, stat blocks, histograms,
+sensor table, stdout buffer), output files are written with plain syscalls, and the frame
+buffer is a fixed size array. Config reloads allocate, but on the event loop thread.
+
+Building with -DPIOOK_ALLOC_CHECK replaces malloc and friends (and hence operator new) with
+versions that abort if called on a thread that is inside the hot path once warm-up (the first
+published reading) is complete.
+=============================================================*/
+char _stdoutBuf[4096];
+
+#ifdef PIOOK_ALLOC_CHECK
+__thread int _tlsInHotPath = 0;
+int _allocCheckArmed = 0;
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* p);
+
+void allocCheck()
+{
+    if(_tlsInHotPath && __atomic_load_n(&_allocCheckArmed, __ATOMIC_RELAXED))
+    {   // No stdio here; it may allocate.
+        static const char msg[] = "piook: heap allocation on the hot path after warm-up.\n";
+        if(write(STDERR_FILENO, msg, sizeof(msg) - 1)) {}
+        abort();
+    }
+}
+
+extern "C" void* malloc(size_t size) { allocCheck(); return __libc_malloc(size); }
+extern "C" void* calloc(size_t n, size_t size) { allocCheck(); return __libc_calloc(n, size); }
+extern "C" void* realloc(void* p, size_t size) { allocCheck(); return __libc_realloc(p, size); }
+extern "C" void* memalign(size_t alignment, size_t size) { allocCheck(); return __libc_memalign(alignment, size); }
+extern "C" void* aligned_alloc(size_t alignment, size_t size) { allocCheck(); return __libc_memalign(alignment, size); }
+extern "C" int posix_memalign(void** p, size_t alignment, size_t size)
+{
+    allocCheck();
+    *p = __libc_memalign(alignment, size);
+    return NULL == *p ? ENOMEM : 0;
+}
+extern "C" void free(void* p) { __libc_free(p); }
+
+void armAllocCheck()
+{
+    __atomic_store_n(&_allocCheckArmed, 1, __ATOMIC_RELAXED);
+}
+#endif
 
 int main(int argc, char *argv[]) 
 {
-    // Parse command line options.
+    // Give stdout a static buffer now, rather than stdio allocating one on first use from the decoder thread.
+    setvbuf(stdout, _stdoutBuf, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, sizeof(_stdoutBuf));
+
+    // Parse command line options, warm start from the state snapshot (if any), and build the initial decoder config.
     parseOptions(argc, argv);
+    int haveSnapshot = NULL != _stateFilename && NULL == _replayFilename && 0 == loadSnapshot(_stateFilename);
+    _publishedConfig = buildConfig();
+    if(NULL == _publishedConfig) {
+        exit(1);
+    }
+    initPipelines();
+    applyGlitchFilter();
+    applyNoiseFolding();
+    if(NULL != _benchFilename) {
+        exit(benchMain());
+    }
+    if(NULL != _replayFilename) {
+        exit(replayMain());
+    }
 
-    struct timespec tim;
-    tim.tv_sec = 0;
-    tim.tv_nsec = 500000000L;
+    // Publish the last known reading straight away rather than waiting up to a minute for the next transmission.
+    decoderConfigCheckpoint();
+    if(haveSnapshot) {
+        publishLastReading();
+    }
 
     // Init GPIO and wiringPi using the wiringPi 'simplified' pin numbering scheme.
     // Scheme is defined at http://wiringpi.com/pins/
@@ -26,256 +179,3952 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    // Block the signals handled by the event loop before any threads are created, so that every
+    // thread (including wiringPi's ISR thread) inherits the mask and the signals are only ever
+    // delivered via the event loop's signalfd.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    // Start the output's sink thread, then the decoder thread; the interrupt handler only timestamps
+    // edges and queues them for the decoder, and the decoder queues readings for the sink.
+    if(0 != startSink(&_outputSink, "output", &writeOutputReading) || 0 != startSink(&_alertSink, "alerts", &writeAlert)
+        || 0 != startSink(&_aggregateSink, "aggregate", &writeAggregate))
+    {
+        fprintf(stderr, "piook: failed to start sink thread.\n");
+        exit(1);
+    }
+    if(NULL != _recordFilename && 0 != openRecording(&_recording, _recordFilename))
+    {
+        fprintf(stderr, "piook: cannot create recording %s.\n", _recordFilename);
+        exit(1);
+    }
+    if(NULL != _flightDir && 0 != startFlightRecorder())
+    {
+        fprintf(stderr, "piook: failed to start the flight recorder.\n");
+        exit(1);
+    }
+    sem_init(&_edgeRingSem, 0, 0);
+    _decoderDoneFd = eventfd(0, EFD_CLOEXEC);
+    pthread_t decoderThreadId;
+    if(-1 == _decoderDoneFd || 0 != pthread_create(&decoderThreadId, NULL, &decoderThread, NULL))
+    {
+        fprintf(stderr, "piook: failed to start decoder thread.\n");
+        exit(1);
+    }
+
     // Hook-up interrupt service routine.
     wiringPiISR(_pinNum, INT_EDGE_BOTH, &handleInterrupt);
 
-    // Main thread now sleeps.
+    int exitCode = runEventLoop(&sigs);
+    if(0 == exitCode) {
+        pthread_join(decoderThreadId, NULL);
+    }
+    if(NULL != _stateFilename) {
+        saveSnapshot(_stateFilename);
+    }
+    exit(exitCode);
+}
+
+/*===========================================================
+Event loop.
+The main thread sleeps in poll() until there is work: a signal (via signalfd), the periodic
+tick (timerfd), the end of a capture source switch's grace period (a one-shot timerfd), or
+the decoder thread reporting that it has drained (eventfd). The periodic
+tick hosts the housekeeping tasks (watchdog, profiler, stdout flush) so that they do not each
+need a thread of their own.
+
+SIGTERM and SIGINT trigger an orderly shutdown: capture is stopped, the decoder drains the
+edge ring and decodes any frame in progress, and the output is synced before exit. SIGHUP
+reloads the config file (see hot reload below). SIGUSR1 dumps the stats and latency
+histograms to stderr.
+=============================================================*/
+const int __tickMs = 1000;
+const int __drainTimeoutMs = 2000;
+int _decoderDoneFd = -1;
+int _shutdownRequested = 0;
+
+int runEventLoop(const sigset_t* sigs)
+{
+    int sigFd = signalfd(-1, sigs, SFD_CLOEXEC);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    _captureSwitchFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(-1 == sigFd || -1 == timerFd || -1 == _captureSwitchFd)
+    {
+        fprintf(stderr, "piook: failed to create event loop fds.\n");
+        return 1;
+    }
+
+    struct itimerspec tick;
+    tick.it_interval.tv_sec = __tickMs / 1000;
+    tick.it_interval.tv_nsec = (__tickMs % 1000) * 1000000L;
+    tick.it_value = tick.it_interval;
+    timerfd_settime(timerFd, 0, &tick, NULL);
+
+    struct pollfd fds[4];
+    fds[0].fd = sigFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timerFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = _decoderDoneFd;
+    fds[2].events = POLLIN;
+    fds[3].fd = _captureSwitchFd;
+    fds[3].events = POLLIN;
+
+    uint64_t ticks = 0;
+    uint64_t drainDeadlineNs = 0;
     for(;;)
     {
-        //printf("loopy");
-        fflush(stdout);
-        nanosleep(&tim, NULL);
+        if(-1 == poll(fds, 4, _shutdownRequested ? 100 : -1))
+        {
+            if(EINTR == errno) {
+                continue;
+            }
+            fprintf(stderr, "piook: poll failed (%d).\n", errno);
+            return 1;
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if(sizeof(info) == read(sigFd, &info, sizeof(info)))
+            {
+                if(SIGUSR1 == info.ssi_signo)
+                {
+                    printStats(stderr);
+                    printSinkStats(stderr);
+                    printHistograms(stderr);
+                    printArchiveStats(stderr);
+                }
+                else if(SIGHUP == info.ssi_signo)
+                {
+                    _reloadRequested = 1;
+                    serviceConfigReload();
+                }
+                else if(!_shutdownRequested)
+                {
+                    fprintf(stderr, "piook: signal %d received, shutting down.\n", info.ssi_signo);
+                    beginShutdown();
+                    drainDeadlineNs = monotonicNs() + __drainTimeoutMs * 1000000ULL;
+                }
+            }
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            uint64_t expirations;
+            if(sizeof(expirations) == read(timerFd, &expirations, sizeof(expirations)))
+            {
+                ticks += expirations;
+                fflush(stdout);
+                if(!_shutdownRequested)
+                {
+                    serviceConfigReload();
+                    watchdogTick();
+                    jitterTick(_publishedConfig);
+                    if(NULL != _flightDir) {
+                        flightRecorderTick(monotonicNs());
+                    }
+                    nearMissTick(_publishedConfig);
+                    staleRulesTick(_publishedConfig, monotonicNs());
+                    aggregateTick(_publishedConfig, 0);
+                    if(NULL != _stateFilename && 0 == ticks % (__snapshotIntervalSec * 1000 / __tickMs)) {
+                        saveSnapshot(_stateFilename);
+                    }
+                }
+                if(_profile && 0 == ticks % (__profileIntervalSec * 1000 / __tickMs)) {
+                    printProfile(stderr);
+                }
+            }
+        }
+
+        if(fds[3].revents & POLLIN)
+        {   // A capture source switch has had its grace period (see setCaptureMode()).
+            uint64_t expirations;
+            if(sizeof(expirations) == read(_captureSwitchFd, &expirations, sizeof(expirations))) {
+                completeCaptureSwitch();
+            }
+        }
+
+        if(fds[2].revents & POLLIN)
+        {   // Decoder has drained and exited; everything it published has been synced.
+            fflush(stdout);
+            return 0;
+        }
+
+        if(_shutdownRequested && monotonicNs() > drainDeadlineNs)
+        {
+            fprintf(stderr, "piook: timed out waiting for the decoder to drain.\n");
+            fflush(stdout);
+            return 1;
+        }
     }
 }
 
+// Stop capture and ask the decoder to drain the ring and finish any frame in progress.
+void beginShutdown()
+{
+    _shutdownRequested = 1;
+    __atomic_store_n(&_captureMode, (int)CAPTURE_SWITCHING, __ATOMIC_RELAXED);
+    setPinEdge("none");
+    __atomic_store_n(&_decoderShutdown, 1, __ATOMIC_RELEASE);
+    sem_post(&_edgeRingSem);
+}
+
 /*===========================================================
-We record received 'pulses'; there are three kinds of pulse:
-1 - short 'off' pulse. Represents a binary 1.
-2 - long 'off' pulse. Represents a binary 0.
-3 - 'on' pulse. 
-0 - Represents a 'noise' pulse.
+Configuration and hot reload.
+The decoder settings (timing windows, glitch filter, output settings) live in an immutable
+decoderConfig, built from the command line overlaid with the optional config file (--config).
+On SIGHUP a complete new config is built alongside the one in use and published with a single
+atomic pointer store. The decoder thread only switches config between frames (when no bits are
+buffered), so a frame is never decoded with a mix of old and new settings, and capture carries
+on throughout. The old config is reclaimed RCU style; the decoder acknowledges each config it
+switches to, and the retired config is freed once the decoder has acknowledged its successor.
+Only one retired config is outstanding at a time; a further reload waits until it is reclaimed.
+The pin number cannot be reloaded; it is bound to the wiringPi ISR.
 =============================================================*/
-const int __maxBits = 128;
-int _bitBuff[__maxBits+1];
-int _bitIdx = 0;
+decoderConfig _baseConfig;              // From the command line.
+char* _configFilename = NULL;
+decoderConfig* _publishedConfig = NULL; // Latest published config; owned by the event loop thread.
+decoderConfig* _retiredConfig = NULL;   // Previous config, freed once the decoder has moved on from it.
+decoderConfig* _decoderCfgAck = NULL;   // Config in use by the decoder (written by the decoder thread only).
+decoderConfig* _decoderConfig = NULL;   // The decoder thread's current config.
+int _reloadRequested = 0;
 
-void handleInterrupt() 
+int validateConfig(const decoderConfig* c)
 {
-    // FIXME: These static variables are unsafe because the interrupt handler can get called
-    // while a handler is already running (maximum of two calls at a time according to wiringPi docs).
-    // Perhaps use a spinlock? 
-    // Ideally I'd like to queue the work for another thread to perform, but that's beyond my 
-    // C++/Linux abilities right now!
-    static unsigned int duration;
-    static unsigned long lastTime;
-    static int prevPulse = 0;
+    const char* err = configError(c);
+    if(NULL != err)
+    {
+        fprintf(stderr, "piook: config error; %s (jitter %u, glitch filter %u).\n", err, c->jitterWindow, c->glitchFilterMu);
+        return -1;
+    }
+    if((SINK_BLOCK == c->sinkPolicy || SINK_BLOCK == c->alertSinkPolicy || SINK_BLOCK == c->aggregateSinkPolicy) && NULL == _replayFilename)
+    {   // Waiting for a sink would stall the decoder, and in turn capture.
+        fprintf(stderr, "piook: config error; sink policy 'block' is only allowed when decoding offline.\n");
+        return -1;
+    }
+    if(SINK_COALESCE == c->alertSinkPolicy)
+    {   // Coalescing by sensor would replace one rule's transition with another's.
+        fprintf(stderr, "piook: config error; the alert sink cannot coalesce.\n");
+        return -1;
+    }
+    if(c->nearMiss && 0 == c->outfilename[0])
+    {   // The log is outfile.nearmiss; binary records have no place on stdout.
+        fprintf(stderr, "piook: config error; near_miss needs an output file.\n");
+        return -1;
+    }
+    if(c->adaptiveJitter)
+    {   // The window may be adapted anywhere between the limits.
+        static decoderConfig widest;
+        widest = *c;
+        widest.jitterWindow = c->jitterMaxMu;
+        setTimingWindows(&widest);
+        if(c->jitterMinMu > c->jitterMaxMu || NULL != configError(&widest))
+        {
+            fprintf(stderr, "piook: config error; jitter limits %u-%u are invalid for the pulse durations.\n", c->jitterMinMu, c->jitterMaxMu);
+            return -1;
+        }
+    }
+    err = rulesError(c);
+    if(NULL != err)
+    {
+        fprintf(stderr, "piook: config error; %s.\n", err);
+        return -1;
+    }
+    return 0;
+}
 
-    // Get current time and IO pin level.
-    long time = micros();
-    int highLow = digitalRead(_pinNum);
+// Parse a config value that must be a whole number from min to max. Returns -1 if it is anything else.
+static int parseConfigUint(const char* value, unsigned int min, unsigned int max, unsigned int* v)
+{
+    char* end;
+    if(!isdigit((unsigned char)value[0])) {
+        return -1;      // Empty, or a sign (strtoul would accept and negate '-').
+    }
+    errno = 0;
+    unsigned long u = strtoul(value, &end, 10);
+    if(0 != *end || ERANGE == errno || u < min || u > max) {
+        return -1;
+    }
+    *v = (unsigned int)u;
+    return 0;
+}
 
-    // Calc duration since last interrupt.
-    // TODO: Get high precision interrupt time? (i.e. recorded with the actual interrupt)
-    duration = time - lastTime;
-    lastTime = time;
-
-    // ENHANCEMENT: The below logic relies on a noise pulse to trigger attempted decoding of a received message; we should attempt decode 
-    // upon reception of enough bits and perhaps use a circular buffer.
-    
-    // Decode pulse.
-    int code = decodePulse(highLow, duration);
-    if(0 == code)
-    {   // Noise detected.
-        // If we have buffered data then now is a good time to dump it.   
-        if(_bitIdx != 0)
-        {
-            int preambleIdx = scanForPreamble();
-            if(-1 != preambleIdx) {
-                processSequence(preambleIdx + 4);
-            }   
-        }
-
-        // Reset pulseBuff.
-        _bitIdx = 0;
-        prevPulse = 0;
-        return;
+// Overlay settings from a config file of 'key = value' lines ('#' starts a comment).
+int loadConfigFile(const char* filename, decoderConfig* c)
+{
+    FILE* f = fopen(filename, "r");
+    if(NULL == f)
+    {
+        fprintf(stderr, "piook: cannot open config file %s.\n", filename);
+        return -1;
     }
 
-    // All recorded 'off' pulses must be preceded by an 'on' pulse.
-    if(3 == prevPulse)
+    char line[1100];
+    int lineNum = 0;
+    int result = 0;
+    while(NULL != fgets(line, sizeof(line), f))
     {
-        if(3 == code)
-        {   // 'On' pulse followed by another is not really possible, but if it does
-            // occur then just ignore and wait for an 'off' pulse.
-            return;
+        lineNum++;
+        char* hash = strchr(line, '#');
+        if(NULL != hash) {
+            *hash = 0;
+        }
+
+        char key[64];
+        char value[1024];
+        int n = sscanf(line, " %63[a-z_] = %1023[^\n]", key, value);
+        if(n <= 0) {
+            continue;   // Blank line.
+        }
+        for(int len = 2 == n ? strlen(value) : 0; len > 0 && isspace((unsigned char)value[len-1]); len--) {
+            value[len-1] = 0;
         }
 
-        // 'Off' pulse received.
-        if(_bitIdx >= __maxBits)
-        {   // Pulse train is longer than expected. Reset buffer.
-            _bitIdx = 0;
+        unsigned int uval = 0;
+        if(2 != n) {
+            result = -1;
+        }
+        else if(0 == strcmp(key, "on_us")) {
+            result = parseConfigUint(value, 1, __maxConfigMu, &c->onMu);
+        }
+        else if(0 == strcmp(key, "off_short_us")) {
+            result = parseConfigUint(value, 1, __maxConfigMu, &c->offShortMu);
+        }
+        else if(0 == strcmp(key, "off_long_us")) {
+            result = parseConfigUint(value, 1, __maxConfigMu, &c->offLongMu);
+        }
+        else if(0 == strcmp(key, "jitter_us")) {
+            result = parseConfigUint(value, 0, __maxConfigMu, &c->jitterWindow);
+        }
+        else if(0 == strcmp(key, "adaptive_jitter")) {
+            result = parseConfigUint(value, 0, 1, &uval);
+            c->adaptiveJitter = (int)uval;
+        }
+        else if(0 == strcmp(key, "jitter_min_us")) {
+            result = parseConfigUint(value, 0, __maxConfigMu, &c->jitterMinMu);
+        }
+        else if(0 == strcmp(key, "jitter_max_us")) {
+            result = parseConfigUint(value, 0, __maxConfigMu, &c->jitterMaxMu);
+        }
+        else if(0 == strcmp(key, "glitch_filter_us")) {
+            result = parseConfigUint(value, 0, __maxConfigMu, &c->glitchFilterMu);
+        }
+        else if(0 == strcmp(key, "fold_noise")) {
+            result = parseConfigUint(value, 0, 1, &uval);
+            c->foldNoise = (int)uval;
+        }
+        else if(0 == strcmp(key, "near_miss")) {
+            result = parseConfigUint(value, 0, 1, &uval);
+            c->nearMiss = (int)uval;
+        }
+        else if(0 == strcmp(key, "quality")) {
+            result = parseConfigUint(value, 0, 1, &uval);
+            c->quality = (int)uval;
+        }
+        else if(0 == strcmp(key, "soft")) {
+            result = parseConfigUint(value, 0, 1, &uval);
+            c->softDecode = (int)uval;
+        }
+        else if(0 == strcmp(key, "outfile")) {
+            snprintf(c->outfilename, sizeof(c->outfilename), "%s", value);
+        }
+        else if(0 == strcmp(key, "format") && -1 != parseRecordFormat(value)) {
+            c->outputFormat = parseRecordFormat(value);
+        }
+        else if(0 == strcmp(key, "stats_windows")) {
+            result = parseStatWindows(value, c);
+        }
+        else if(0 == strcmp(key, "rule")) {
+            result = parseRule(value, c);
+        }
+        else if(0 == strcmp(key, "aggregate_interval"))
+        {
+            char* end;
+            unsigned long sec;
+            result = 0 == parseDuration(value, &end, &sec) && 0 == *end && sec <= __maxAggregateIntervalSec ? 0 : -1;
+            c->aggregateIntervalSec = (unsigned int)sec;
+        }
+        else if(0 == strcmp(key, "aggregate_deadband"))
+        {   // Degrees C or % RH; a deadband of 100 or more would never send.
+            char* end;
+            double deadband = strtod(value, &end);
+            result = end != value && 0 == *end && deadband >= 0 && deadband < 100 ? 0 : -1;
+            c->aggregateDeadband = (int)(deadband * 10 + 0.5);
+        }
+        else if(0 == strcmp(key, "sink_policy") && -1 != parseSinkPolicy(value)) {
+            c->sinkPolicy = parseSinkPolicy(value);
+        }
+        else if(0 == strcmp(key, "sink_queue")) {
+            result = parseConfigUint(value, 1, __sinkQueueMax, &uval);
+            c->sinkQueueLen = (int)uval;
+        }
+        else if(0 == strcmp(key, "alert_sink_policy") && -1 != parseSinkPolicy(value)) {
+            c->alertSinkPolicy = parseSinkPolicy(value);
+        }
+        else if(0 == strcmp(key, "alert_sink_queue")) {
+            result = parseConfigUint(value, 1, __sinkQueueMax, &uval);
+            c->alertSinkQueueLen = (int)uval;
+        }
+        else if(0 == strcmp(key, "aggregate_sink_policy") && -1 != parseSinkPolicy(value)) {
+            c->aggregateSinkPolicy = parseSinkPolicy(value);
+        }
+        else if(0 == strcmp(key, "aggregate_sink_queue")) {
+            result = parseConfigUint(value, 1, __sinkQueueMax, &uval);
+            c->aggregateSinkQueueLen = (int)uval;
+        }
+        else {
+            result = -1;
         }
 
-        // Buffer received bit.
-        _bitBuff[_bitIdx++] = code;
+        if(-1 == result)
+        {
+            fprintf(stderr, "piook: %s line %d not understood.\n", filename, lineNum);
+            break;
+        }
     }
-    prevPulse = code;
+    fclose(f);
+    return result;
 }
 
-/*====================
-Pulse durations in microseconds. These were determined by examining the signal transmitted by a
-ClimeMET CM7-TX, remote unit, transmitting on 433.92 MHz (temperature and humidity sensor).
-ClimeMET CM9088 (Master unit)
-======================*/
-const unsigned int __onMu = 1000;
-const unsigned int __offShortMu = 500;
-const unsigned int __offLongMu = 1500;
+// Build a complete new config. Returns NULL (leaving the current config in place) if it is invalid.
+decoderConfig* buildConfig()
+{
+    decoderConfig* c = (decoderConfig*)malloc(sizeof(decoderConfig));
+    if(NULL == c) {
+        return NULL;
+    }
 
-// We probably need to allow for timing errors/jitter due to code runing on a non-realtime operating system.
-const unsigned int __jitterWindow = 250;
-const unsigned int __onMuUpper = __onMu + __jitterWindow;
-const unsigned int __onMuLower = __onMu - __jitterWindow;
+    *c = _baseConfig;
+    if((NULL != _configFilename && 0 != loadConfigFile(_configFilename, c)))
+    {
+        free(c);
+        return NULL;
+    }
 
-const unsigned int __offShortMuUpper = __offShortMu + __jitterWindow;
-const unsigned int __offShortMuLower = __offShortMu - __jitterWindow;
+    if(c->adaptiveJitter)
+    {   // jitter_us is only the starting point; an adapted window carries over reloads and restarts.
+        if(0 != _adaptedJitterMu) {
+            c->jitterWindow = _adaptedJitterMu;
+        }
+        if(c->jitterWindow < c->jitterMinMu) {
+            c->jitterWindow = c->jitterMinMu;
+        }
+        if(c->jitterWindow > c->jitterMaxMu) {
+            c->jitterWindow = c->jitterMaxMu;
+        }
+    }
 
-const unsigned int __offLongMuUpper = __offLongMu + __jitterWindow;
-const unsigned int __offLongMuLower = __offLongMu - __jitterWindow;
+    setTimingWindows(c);
+    if(0 != validateConfig(c))
+    {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
 
-int decodePulse(int highLow, unsigned int duration)
+// Called on the event loop thread for SIGHUP, and on each tick to reclaim retired configs and
+// retry a reload that had to wait for reclamation.
+void serviceConfigReload()
 {
-    if(0 == highLow)
+    if(NULL != _retiredConfig && _publishedConfig == __atomic_load_n(&_decoderCfgAck, __ATOMIC_ACQUIRE) && !sinksUsingConfig(_retiredConfig))
     {
-        // Test for short 'off' pulse.
-        if(duration > __offShortMuLower && duration < __offShortMuUpper) {
-            return 1;
-        }
-        else if(duration > __offLongMuLower && duration < __offLongMuUpper) {
-            return 2;
-        }
-        return 0;
+        free(_retiredConfig);
+        _retiredConfig = NULL;
+    }
+
+    if(!_reloadRequested || NULL != _retiredConfig) {
+        return;
     }
+    _reloadRequested = 0;
 
-    // Test for 'on' pulse.
-    if(duration > __onMuLower && duration < __onMuUpper) {
-        return 3;
+    decoderConfig* c = buildConfig();
+    if(NULL == c)
+    {
+        fprintf(stderr, "piook: reload failed; keeping the current config.\n");
+        return;
     }
 
-    // Noise.
+    publishConfig(c);
+    fprintf(stderr, "piook: config reloaded.\n");
+}
+
+// Publish a complete new config in place of the current one, which is retired. Event loop thread only,
+// and only when no retired config is outstanding.
+int publishConfig(decoderConfig* c)
+{
+    if(NULL != _retiredConfig) {
+        return -1;
+    }
+    _retiredConfig = _publishedConfig;
+    __atomic_store_n(&_publishedConfig, c, __ATOMIC_SEQ_CST);
+    applyGlitchFilter();
+    applyNoiseFolding();
     return 0;
 }
 
-// Scan the buffered pulses for the fixed preamble sequence.
-int scanForPreamble()
+// Decoder thread; adopt the latest published config. Only called between frames.
+void decoderConfigCheckpoint()
+{
+    decoderConfig* c = __atomic_load_n(&_publishedConfig, __ATOMIC_ACQUIRE);
+    if(c != _decoderConfig)
+    {
+        _decoderConfig = c;
+        _decoder.setConfig(c);
+        __atomic_store_n(&_decoderCfgAck, c, __ATOMIC_RELEASE);
+    }
+}
+
+/*===========================================================
+Warm start state snapshot (--state).
+The learned sensors (with their last readings) and the learned timing calibration (the adapted
+jitter window; configured settings are never saved, so the config file and defaults stay in
+charge of them) are saved to a compact binary snapshot periodically and at shutdown, and loaded
+at startup, so that after a restart or reboot the calibration is back at once and the last
+readings are published immediately. The file is a single fixed-size snapshotFile struct (see piook.h) in native byte
+order with natural alignment, so loading is just mmap and validate; the header records the
+format version, byte order, size and a checksum, and a snapshot that fails any of these checks
+is ignored. Times are saved as wall clock (unix) times since monotonic times do not survive a
+reboot. Files are replaced atomically (see writeFileAtomic()).
+=============================================================*/
+char* _stateFilename = NULL;
+const uint32_t __snapshotVersion = 2;          // 2: only the adapted jitter window is saved as calibration.
+const uint32_t __snapshotByteOrder = 0x01020304;
+
+// FNV-1a; only needs to detect a torn or corrupted file.
+uint32_t snapshotChecksum(const uint8_t* buf, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for(size_t i=0; i<len; i++)
+    {
+        h ^= buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int saveSnapshot(const char* filename)
 {
-    static int preambleSeq[8] = {1, 1, 1, 1, 2, 1, 2, 2};
+    static snapshotFile snap;
+    memset(&snap, 0, sizeof(snap));
+    memcpy(snap.header.magic, "PIOOKSNP", 8);
+    snap.header.version = __snapshotVersion;
+    snap.header.byteOrder = __snapshotByteOrder;
+    snap.header.size = sizeof(snapshotFile);
+    snap.header.savedAtUnix = (int64_t)time(NULL);
+
+    snap.calibration.adaptedJitterMu = _adaptedJitterMu;
 
-    for(int i=0; i<_bitIdx-8; i++)
+    // Sensor state is written by the decoder thread; a reading may be a moment stale but each field is read atomically.
+    int64_t nowUnix = snap.header.savedAtUnix;
+    uint64_t nowNs = monotonicNs();
+    int sensorCount = __atomic_load_n(&_sensorCount, __ATOMIC_ACQUIRE);
+    for(int i=0; i<sensorCount; i++)
     {
-        int j=0;
-        for(; j<8 && _bitBuff[j+i] == preambleSeq[j]; j++);
-                
-        if(8==j) {
-            return i;
-        }
+        snapshotSensor* out = &snap.sensors[i];
+        out->id = _sensors[i].id;
+        out->tempInt = __atomic_load_n(&_sensors[i].tempInt, __ATOMIC_RELAXED);
+        out->rh = __atomic_load_n(&_sensors[i].rh, __ATOMIC_RELAXED);
+        uint64_t heardNs = __atomic_load_n(&_sensors[i].lastHeardNs, __ATOMIC_RELAXED);
+        out->lastHeardUnix = nowUnix - (int64_t)((nowNs - heardNs) / 1000000000ULL);
     }
-    return -1;
+    snap.sensorCount = sensorCount;
+
+    snap.header.checksum = snapshotChecksum((const uint8_t*)&snap + sizeof(snap.header), sizeof(snap) - sizeof(snap.header));
+    if(0 != writeFileAtomic(filename, (const char*)&snap, sizeof(snap)))
+    {
+        fprintf(stderr, "piook: failed to save state snapshot %s.\n", filename);
+        return -1;
+    }
+    return 0;
 }
 
-void processSequence(int preambleIdx)
+// Called once at startup, before any other threads exist.
+int loadSnapshot(const char* filename)
 {
-    // Convert the buffered bits into a byte array.
-    int bitLen = _bitIdx - preambleIdx;
-    int dataLen = bitLen / 8;
-    uint8_t data[dataLen];
-    int idx = preambleIdx;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(-1 == fd) {
+        return -1;  // No snapshot yet.
+    }
+
+    struct stat st;
+    const snapshotFile* snap = NULL;
+    if(0 == fstat(fd, &st) && sizeof(snapshotFile) == st.st_size)
+    {
+        void* p = mmap(NULL, sizeof(snapshotFile), PROT_READ, MAP_PRIVATE, fd, 0);
+        if(MAP_FAILED != p) {
+            snap = (const snapshotFile*)p;
+        }
+    }
+    close(fd);
 
-    for(int i=0; i<dataLen; i++)
+    int result = -1;
+    if(NULL != snap
+        && 0 == memcmp(snap->header.magic, "PIOOKSNP", 8)
+        && __snapshotVersion == snap->header.version
+        && __snapshotByteOrder == snap->header.byteOrder
+        && sizeof(snapshotFile) == snap->header.size
+        && snap->sensorCount <= (uint32_t)__maxSensors
+        && snap->header.checksum == snapshotChecksum((const uint8_t*)snap + sizeof(snap->header), sizeof(*snap) - sizeof(snap->header)))
     {
-        uint8_t b = 0;
-        uint8_t mask = 0x80;
+        _adaptedJitterMu = snap->calibration.adaptedJitterMu;
 
-        for(int j=0; j<8; j++, idx++)
+        // Map the saved wall clock times onto the monotonic clock.
+        int64_t nowUnix = (int64_t)time(NULL);
+        uint64_t nowNs = monotonicNs();
+        for(uint32_t i=0; i<snap->sensorCount; i++)
         {
-            if(1==_bitBuff[idx]) {
-                b += mask;
-            }
-            mask = mask >> 1;
+            const snapshotSensor* in = &snap->sensors[i];
+            uint64_t agoNs = in->lastHeardUnix < nowUnix ? (uint64_t)(nowUnix - in->lastHeardUnix) * 1000000000ULL : 0;
+            _sensors[i].id = in->id;
+            _sensors[i].tempInt = in->tempInt;
+            _sensors[i].rh = in->rh;
+            _sensors[i].lastHeardNs = agoNs < nowNs ? nowNs - agoNs : 0;
         }
-        data[i] = b;
+        _sensorCount = snap->sensorCount;
+        result = 0;
+    }
+    else {
+        fprintf(stderr, "piook: ignoring invalid state snapshot %s.\n", filename);
     }
 
-    // For debugging only.
-    //printHex(data, dataLen);
+    if(NULL != snap) {
+        munmap((void*)snap, sizeof(snapshotFile));
+    }
+    return result;
+}
 
-    // Validation.
-    if(5 != dataLen)
-    {   // Reject.
-        return;
+// Publish the reading of the most recently heard sensor (from a loaded snapshot).
+void publishLastReading()
+{
+    int latest = -1;
+    for(int i=0; i<_sensorCount; i++)
+    {
+        if(-1 == latest || _sensors[i].lastHeardNs > _sensors[latest].lastHeardNs) {
+            latest = i;
+        }
     }
 
-    // Calc checksum.
-    uint8_t checksum = crc8(data, 4);
-    if(checksum != data[4])
-    {   // Reject.
-        return;
+    if(-1 != latest) {
+        reading r;
+        memset(&r, 0, sizeof(r));
+        r.protocol = PIOOK_PROTOCOL_CM7;
+        r.sensorId = _sensors[latest].id;
+        r.tempInt = _sensors[latest].tempInt;
+        r.rh = _sensors[latest].rh;
+        publishReading(_publishedConfig, r, NULL);
     }
+}
+
+/*===========================================================
+Edge archive (--record, --replay).
+A recording of the edges seen by the decoder, for decoding offline later; e.g. to find out
+what went wrong with the transmission at 03:12 on a noisy site. Edges are stored in blocks of
+up to __archiveBlockEdges (or __archiveBlockMaxNs), each compressed on its own: an edge is a
+varint of its time since the previous edge in microseconds, shifted left over a span flag
+and the pin level, followed by the edge count of a noise span (see noiseFolder). Noise edges
+are typically a few hundred microseconds apart, so most edges take two bytes rather than the
+sixteen of an edgeEvent. A sparse index at the end of the file (each block's first capture
+time and offset) means a seek is a binary search of the index and decoding one block. Block
+headers carry the same information, so a recording that was cut short (no index) is still
+readable; the index is rebuilt by walking the block headers.
 
-    // Parse data.
-    // Temperature.
-    int tempInt = ((data[1] & 0x07) << 8) + data[2];
-    if(data[1] & 0x08) {
-        tempInt *= -1;
+Recording is done on the decoder thread, so it sees the edges that the decoder sees (after
+the glitch filter, and folded if fold_noise is on). Encoding an edge is a few instructions;
+full blocks are handed to a writer thread, and a block is dropped (and counted) rather than
+stall the decoder if the writer falls behind.
+=============================================================*/
+const uint32_t __archiveVersion = 1;
+const uint32_t __archiveBlockMagic = 0x4B4C4250;     // "PBLK"
+const uint32_t __archiveIndexMagic = 0x58444950;     // "PIDX"
+
+char* _recordFilename = NULL;
+char* _replayFilename = NULL;
+replayTime _replayFrom;                  // --from/--to; unset for the start/end.
+replayTime _replayTo;
+int64_t _replayClockOffsetNs = 0;       // Maps the recording's capture times onto its wall clock.
+edgeArchive _recording;
+
+static inline uint8_t* putVarint(uint8_t* p, uint64_t v)
+{
+    while(v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
     }
-    float tempCelsius = tempInt * 0.1;
+    *p++ = (uint8_t)v;
+    return p;
+}
 
-    // Relative humidity.
-    int rh = data[3];
+static inline const uint8_t* getVarint(const uint8_t* p, const uint8_t* end, uint64_t* v)
+{
+    uint64_t value = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *p++;
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if(0 == (b & 0x80))
+        {
+            *v = value;
+            return p;
+        }
+    }
+    return NULL;
+}
 
-    // Write to file.
-    if(NULL != _outfilename)
+// Write a whole buffer at the current file position.
+static int writeAll(int fd, const void* buf, size_t len)
+{
+    for(size_t written = 0; written < len; )
     {
-        FILE *f = fopen(_outfilename, "w");
-        fprintf(f, "%3.2f,%d\n", tempCelsius, rh); 
-        fclose(f);
+        ssize_t n = write(fd, (const char*)buf + written, len - written);
+        if(n > 0) {
+            written += n;
+        }
+        else if(-1 == n && EINTR == errno) {
+            continue;
+        }
+        else {
+            return -1;
+        }
     }
-    else
+    return 0;
+}
+
+// True if the edge should start a new block rather than go in b.
+static inline int archiveBlockAged(const archiveBlock* b, const edgeEvent& e)
+{
+    return 0 != b->header.edgeCount && e.captureNs - b->header.firstNs > __archiveBlockMaxNs;
+}
+
+// Append an edge to a block (*lastMu is the previous edge's time). Returns 1 once the block is full.
+static int encodeArchiveEdge(archiveBlock* b, uint32_t* lastMu, const edgeEvent& e)
+{
+    if(0 == b->header.edgeCount)
     {
-        printf("Temp: %4.2f, RH: %d\n", tempCelsius, rh);
+        b->header.firstNs = e.captureNs;
+        b->header.firstMu = e.timeMu;
+        *lastMu = e.timeMu;
+    }
+    int span = 0 != e.spanEdges;
+    uint8_t* p = putVarint(b->data + b->header.dataLen, (uint64_t)(e.timeMu - *lastMu) << 2 | span << 1 | (0 != e.highLow));
+    if(span) {
+        p = putVarint(p, e.spanEdges);
     }
+    b->header.dataLen = p - b->data;
+    b->header.lastNs = e.captureNs;
+    *lastMu = e.timeMu;
+    return ++b->header.edgeCount >= (uint32_t)__archiveBlockEdges;
 }
 
-/*
-* Function taken from Luc Small (http://lucsmall.com), itself
-* derived from the OneWire Arduino library. Modifications to
-* the polynomial according to Fine Offset's CRC8 calulations.
-*/
-uint8_t crc8(uint8_t *addr, uint8_t len)
+static void finishArchiveBlock(archiveBlock* b)
 {
-    uint8_t crc = 0;
+    b->header.magic = __archiveBlockMagic;
+    b->header.checksum = snapshotChecksum(b->data, b->header.dataLen);
+}
 
-    // Indicated changes are from reference CRC-8 function in OneWire library
-    while (len--) {
-        uint8_t inbyte = *addr++;
-        uint8_t i;
-        for (i = 8; i; i--) {
-            uint8_t mix = (crc ^ inbyte) & 0x80; // changed from & 0x01
-            crc <<= 1; // changed from right shift
-            if (mix) crc ^= 0x31;// changed from 0x8C;
-            inbyte <<= 1; // changed from right shift
-        }
+static void initArchiveHeader(archiveHeader* h)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "PIOOKARC", 8);
+    h->version = __archiveVersion;
+    h->byteOrder = __snapshotByteOrder;
+    h->startUnixNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    h->startMonoNs = monotonicNs();
+}
+
+// Start a recording, replacing any existing file. Called once at startup.
+int openRecording(edgeArchive* a, const char* filename)
+{
+    memset(a, 0, sizeof(*a));
+    a->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(-1 == a->fd) {
+        return -1;
+    }
+
+    initArchiveHeader(&a->header);
+    if(0 != writeAll(a->fd, &a->header, sizeof(a->header)))
+    {
+        close(a->fd);
+        return -1;
+    }
+    a->offset = sizeof(a->header);
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->notEmpty, NULL);
+    if(0 != pthread_create(&a->thread, NULL, &archiveWriterThread, a))
+    {
+        close(a->fd);
+        return -1;
     }
-    return crc;
+    return 0;
 }
 
-void parseOptions(int argc, char *argv[])
+// Hand the block being filled to the writer thread (or drop it if the queue is full) and start another.
+static void completeBlock(edgeArchive* a)
 {
-    if(3 != argc) {
-        printHelp();
-        exit(1);
+    pthread_mutex_lock(&a->lock);
+    if(a->count < __archiveQueueBlocks - 1)
+    {
+        a->count++;
+        a->fill = (a->fill + 1) % __archiveQueueBlocks;
+        pthread_cond_signal(&a->notEmpty);
+    }
+    else {
+        __atomic_store_n(&a->blocksDropped, a->blocksDropped + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&a->lock);
+    a->blocks[a->fill].header.edgeCount = 0;
+    a->blocks[a->fill].header.dataLen = 0;
+}
+
+// Decoder thread.
+void recordEdge(edgeArchive* a, const edgeEvent& e)
+{
+    if(archiveBlockAged(&a->blocks[a->fill], e)) {
+        completeBlock(a);
+    }
+    __atomic_store_n(&a->edges, a->edges + 1, __ATOMIC_RELAXED);
+    if(encodeArchiveEdge(&a->blocks[a->fill], &a->lastMu, e)) {
+        completeBlock(a);
+    }
+}
+
+// Writes queued blocks, noting each in the index. A block's header is finished here, off the decoder thread.
+void* archiveWriterThread(void* arg)
+{
+    edgeArchive* a = (edgeArchive*)arg;
+    for(;;)
+    {
+        pthread_mutex_lock(&a->lock);
+        while(0 == a->count && !a->closed) {
+            pthread_cond_wait(&a->notEmpty, &a->lock);
+        }
+        if(0 == a->count)
+        {   // Closed and drained.
+            pthread_mutex_unlock(&a->lock);
+            break;
+        }
+        archiveBlock* b = &a->blocks[a->head];
+        pthread_mutex_unlock(&a->lock);
+
+        finishArchiveBlock(b);
+        if(a->indexCount == a->indexCap)
+        {
+            uint32_t cap = 0 == a->indexCap ? 1024 : a->indexCap * 2;
+            archiveIndexEntry* index = (archiveIndexEntry*)realloc(a->index, cap * sizeof(archiveIndexEntry));
+            if(NULL != index)
+            {
+                a->index = index;
+                a->indexCap = cap;
+            }
+        }
+        if(a->indexCount < a->indexCap && 0 == writeAll(a->fd, b, sizeof(b->header) + b->header.dataLen))
+        {
+            a->index[a->indexCount].firstNs = b->header.firstNs;
+            a->index[a->indexCount].offset = a->offset;
+            a->indexCount++;
+            a->offset += sizeof(b->header) + b->header.dataLen;
+            __atomic_store_n(&a->blocksWritten, a->blocksWritten + 1, __ATOMIC_RELAXED);
+        }
+        else
+        {   // Leave the file ending on a whole block.
+            if(0 != ftruncate(a->fd, a->offset) || (off_t)-1 == lseek(a->fd, a->offset, SEEK_SET)) {
+                fprintf(stderr, "piook: recording write failed.\n");
+            }
+            __atomic_store_n(&a->blocksDropped, a->blocksDropped + 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&a->lock);
+        a->head = (a->head + 1) % __archiveQueueBlocks;
+        a->count--;
+        pthread_mutex_unlock(&a->lock);
+    }
+    return NULL;
+}
+
+// Write out the block in progress and the queued blocks, then the index. Called once the decoder has stopped.
+void closeRecording(edgeArchive* a)
+{
+    if(0 != a->blocks[a->fill].header.edgeCount) {
+        completeBlock(a);
+    }
+    pthread_mutex_lock(&a->lock);
+    a->closed = 1;
+    pthread_cond_broadcast(&a->notEmpty);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+
+    archiveTrailer trailer;
+    trailer.indexOffset = a->offset;
+    trailer.blockCount = a->indexCount;
+    trailer.magic = __archiveIndexMagic;
+    if(0 != writeAll(a->fd, a->index, a->indexCount * sizeof(archiveIndexEntry)) || 0 != writeAll(a->fd, &trailer, sizeof(trailer))
+        || 0 != fsync(a->fd)) {
+        fprintf(stderr, "piook: failed to write the recording index.\n");
+    }
+    close(a->fd);
+    free(a->index);
+}
+
+// Write a complete archive of the given edges (the flight recorder's dumps). Replaces the file atomically.
+int writeArchiveFile(const char* filename, const edgeEvent* edges, int n)
+{
+    static archiveBlock block;      // Only called from the flight recorder's dump thread.
+
+    char tmpName[1100];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", filename);
+    int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(-1 == fd) {
+        return -1;
+    }
+
+    // A block per __archiveBlockEdges, plus one each time a block is closed for its age.
+    uint32_t maxBlocks = n / __archiveBlockEdges + 2;
+    if(n > 0) {
+        maxBlocks += (uint32_t)((edges[n-1].captureNs - edges[0].captureNs) / __archiveBlockMaxNs);
+    }
+    archiveIndexEntry* index = (archiveIndexEntry*)malloc(maxBlocks * sizeof(archiveIndexEntry));
+    archiveHeader header;
+    initArchiveHeader(&header);
+    if(n > 0)
+    {   // The recording starts at its first edge, not when it is written (--from/--to offsets count from the start).
+        header.startUnixNs -= (int64_t)(header.startMonoNs - edges[0].captureNs);
+        header.startMonoNs = edges[0].captureNs;
+    }
+    int ok = NULL != index && 0 == writeAll(fd, &header, sizeof(header));
+
+    archiveTrailer trailer;
+    trailer.indexOffset = sizeof(header);
+    trailer.blockCount = 0;
+    trailer.magic = __archiveIndexMagic;
+    uint32_t lastMu = 0;
+    block.header.edgeCount = 0;
+    block.header.dataLen = 0;
+    for(int i=0; ok && i<=n; i++)
+    {
+        // Write out the block once it is full or aged, and at the end.
+        if(0 != block.header.edgeCount && (i == n || archiveBlockAged(&block, edges[i]) || block.header.edgeCount >= (uint32_t)__archiveBlockEdges))
+        {
+            finishArchiveBlock(&block);
+            index[trailer.blockCount].firstNs = block.header.firstNs;
+            index[trailer.blockCount].offset = trailer.indexOffset;
+            trailer.blockCount++;
+            trailer.indexOffset += sizeof(block.header) + block.header.dataLen;
+            ok = 0 == writeAll(fd, &block, sizeof(block.header) + block.header.dataLen);
+            block.header.edgeCount = 0;
+            block.header.dataLen = 0;
+        }
+        if(i < n) {
+            encodeArchiveEdge(&block, &lastMu, edges[i]);
+        }
+    }
+    ok = ok && 0 == writeAll(fd, index, trailer.blockCount * sizeof(archiveIndexEntry)) && 0 == writeAll(fd, &trailer, sizeof(trailer));
+    ok &= 0 == fsync(fd);
+    ok &= 0 == close(fd);
+    free(index);
+    if(!ok || 0 != rename(tmpName, filename))
+    {
+        unlink(tmpName);
+        return -1;
+    }
+    return 0;
+}
+
+void printArchiveStats(FILE* f)
+{
+    if(NULL != _recordFilename)
+    {
+        fprintf(f, "piook recording: edges=%llu blocks_written=%llu blocks_dropped=%llu\n",
+            (unsigned long long)__atomic_load_n(&_recording.edges, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&_recording.blocksWritten, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&_recording.blocksDropped, __ATOMIC_RELAXED));
+    }
+    if(NULL != _flightDir) {
+        fprintf(f, "piook flight recorder: dumps_dropped=%llu\n", (unsigned long long)__atomic_load_n(&_flightDumpsDropped, __ATOMIC_RELAXED));
+    }
+    fflush(f);
+}
+
+static int readAt(int fd, void* buf, size_t len, uint64_t offset)
+{
+    return (ssize_t)len == pread(fd, buf, len, (off_t)offset) ? 0 : -1;
+}
+
+// Open an archive for reading and load (or rebuild) its index.
+int openArchive(const char* filename, archiveReader* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(-1 == r->fd) {
+        return -1;
+    }
+
+    struct stat st;
+    if(0 != fstat(r->fd, &st) || 0 != readAt(r->fd, &r->header, sizeof(r->header), 0)
+        || 0 != memcmp(r->header.magic, "PIOOKARC", 8) || __archiveVersion != r->header.version
+        || __snapshotByteOrder != r->header.byteOrder)
+    {
+        close(r->fd);
+        return -1;
+    }
+    uint64_t size = st.st_size;
+
+    archiveTrailer trailer;
+    if(size >= sizeof(r->header) + sizeof(trailer) && 0 == readAt(r->fd, &trailer, sizeof(trailer), size - sizeof(trailer))
+        && __archiveIndexMagic == trailer.magic
+        && trailer.indexOffset + (uint64_t)trailer.blockCount * sizeof(archiveIndexEntry) + sizeof(trailer) == size)
+    {
+        r->index = (archiveIndexEntry*)malloc((trailer.blockCount + 1) * sizeof(archiveIndexEntry));
+        if(NULL != r->index && 0 == readAt(r->fd, r->index, trailer.blockCount * sizeof(archiveIndexEntry), trailer.indexOffset))
+        {
+            r->blockCount = trailer.blockCount;
+            return 0;
+        }
+        free(r->index);
+        r->index = NULL;
+    }
+
+    // No index; walk the block headers up to the first incomplete block.
+    uint32_t cap = 0;
+    archiveBlockHeader h;
+    for(uint64_t offset = sizeof(r->header); 0 == readAt(r->fd, &h, sizeof(h), offset); offset += sizeof(h) + h.dataLen)
+    {
+        if(__archiveBlockMagic != h.magic || h.dataLen > (uint32_t)__archiveMaxBlockBytes || offset + sizeof(h) + h.dataLen > size) {
+            break;
+        }
+        if(r->blockCount == cap)
+        {
+            cap = 0 == cap ? 1024 : cap * 2;
+            archiveIndexEntry* index = (archiveIndexEntry*)realloc(r->index, cap * sizeof(archiveIndexEntry));
+            if(NULL == index) {
+                break;
+            }
+            r->index = index;
+        }
+        r->index[r->blockCount].firstNs = h.firstNs;
+        r->index[r->blockCount].offset = offset;
+        r->blockCount++;
+    }
+    fprintf(stderr, "piook: recording %s has no index (cut short?); rebuilt it from %u blocks.\n", filename, r->blockCount);
+    return 0;
+}
+
+void closeArchive(archiveReader* r)
+{
+    close(r->fd);
+    free(r->index);
+}
+
+// The block holding the edges at (or just after) the given capture time; the last block that starts at or
+// before it.
+uint32_t archiveSeek(const archiveReader* r, uint64_t monoNs)
+{
+    uint32_t lo = 0;
+    uint32_t hi = r->blockCount;
+    while(hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(r->index[mid].firstNs <= monoNs) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int readArchiveBlock(const archiveReader* r, uint32_t block, archiveBlock* out)
+{
+    uint64_t offset = r->index[block].offset;
+    if(0 != readAt(r->fd, &out->header, sizeof(out->header), offset)
+        || __archiveBlockMagic != out->header.magic
+        || out->header.dataLen > (uint32_t)__archiveMaxBlockBytes
+        || out->header.edgeCount > (uint32_t)__archiveBlockEdges
+        || 0 != readAt(r->fd, out->data, out->header.dataLen, offset + sizeof(out->header))
+        || out->header.checksum != snapshotChecksum(out->data, out->header.dataLen))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Decode a block's edges into out[] (room for __archiveBlockEdges). Returns the edge count, or -1 if the block is corrupt.
+int decodeArchiveBlock(const archiveBlock* b, edgeEvent* out)
+{
+    const uint8_t* p = b->data;
+    const uint8_t* end = b->data + b->header.dataLen;
+    uint32_t timeMu = b->header.firstMu;
+    for(uint32_t i=0; i<b->header.edgeCount; i++)
+    {
+        uint64_t v;
+        uint64_t spanEdges = 0;
+        p = getVarint(p, end, &v);
+        if(NULL != p && 0 != (v & 2)) {
+            p = getVarint(p, end, &spanEdges);
+        }
+        if(NULL == p) {
+            return -1;
+        }
+        uint32_t delta = (uint32_t)(v >> 2);
+        timeMu += delta;
+        out[i].timeMu = timeMu;
+        out[i].captureNs = b->header.firstNs + (uint64_t)(timeMu - b->header.firstMu) * 1000;
+        out[i].highLow = (int)(v & 1);
+        out[i].spanMu = 0 != spanEdges ? delta : 0;
+        out[i].spanEdges = (unsigned int)spanEdges;
+    }
+    return (int)b->header.edgeCount;
+}
+
+// Parse a --from/--to time: Unix seconds (which may be negative), a local date and time (2026-10-17T03:12 or
+// with seconds), or an offset from the start of the recording (+90m).
+int parseReplayTime(const char* s, replayTime* t)
+{
+    char* end;
+    t->set = 1;
+    t->fromStart = '+' == s[0];
+    if(t->fromStart)
+    {
+        unsigned long sec;
+        if(0 != parseDuration(s + 1, &end, &sec) || 0 != *end) {
+            return -1;
+        }
+        t->ns = (int64_t)sec * 1000000000LL;
+        return 0;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(s, "%Y-%m-%dT%H:%M", &tm);
+    if(NULL != end)
+    {
+        if(':' == *end) {
+            end = strptime(end, ":%S", &tm);
+        }
+        if(NULL == end || 0 != *end) {
+            return -1;
+        }
+        tm.tm_isdst = -1;
+        t->ns = (int64_t)mktime(&tm) * 1000000000LL;
+        return 0;
+    }
+
+    long long sec = strtoll(s, &end, 10);
+    if(end == s || 0 != *end) {
+        return -1;
+    }
+    t->ns = sec * 1000000000LL;
+    return 0;
+}
+
+// Map a --from/--to time onto the recording's capture clock.
+static uint64_t replayTimeToMono(const archiveHeader* h, const replayTime* t)
+{
+    if(t->fromStart) {
+        return h->startMonoNs + (uint64_t)t->ns;
+    }
+    int64_t fromStart = t->ns - h->startUnixNs;
+    return fromStart < 0 && (uint64_t)-fromStart > h->startMonoNs ? 0 : h->startMonoNs + fromStart;
+}
+
+// Decode the edges of a recording between two times (unset for the start/end) through the decode pipeline, as
+// the decoder thread would (see decodeEdges()). Returns 0, or -1 if the recording cannot be read.
+int replayArchive(const char* filename, const replayTime* from, const replayTime* to)
+{
+    // Static because the block and its decoded edges take ~130KB.
+    static archiveReader r;
+    static archiveBlock block;
+    static edgeEvent edges[__archiveBlockEdges];
+
+    if(0 != openArchive(filename, &r))
+    {
+        fprintf(stderr, "piook: cannot read recording %s.\n", filename);
+        return -1;
+    }
+    uint64_t fromNs = from->set ? replayTimeToMono(&r.header, from) : 0;
+    uint64_t toNs = to->set ? replayTimeToMono(&r.header, to) : UINT64_MAX;
+    _replayClockOffsetNs = r.header.startUnixNs - (int64_t)r.header.startMonoNs;
+
+    decoderConfigCheckpoint();
+    uint64_t lastNs = fromNs;
+    int result = 0;
+    for(uint32_t i = 0 == r.blockCount ? 0 : archiveSeek(&r, fromNs); i < r.blockCount && r.index[i].firstNs <= toNs; i++)
+    {
+        int n = 0 == readArchiveBlock(&r, i, &block) ? decodeArchiveBlock(&block, edges) : -1;
+        if(-1 == n)
+        {
+            fprintf(stderr, "piook: skipping corrupt block %u of recording %s.\n", i, filename);
+            result = -1;
+            continue;
+        }
+        int m = 0;
+        for(int j=0; j<n; j++)
+        {
+            if(edges[j].captureNs >= fromNs && edges[j].captureNs <= toNs) {
+                edges[m++] = edges[j];
+            }
+        }
+        if(0 != m)
+        {
+            statAdd(STAT_EDGES, m);
+            decodeEdges(edges, m);
+            lastNs = edges[m-1].captureNs;
+        }
+    }
+    _decoder.flush(lastNs);
+    closeArchive(&r);
+    return result;
+}
+
+// Offline decoding (--replay); in place of GPIO, capture and the event loop. Readings go to the sinks as usual.
+int replayMain()
+{
+    if(0 != startSink(&_outputSink, "output", &writeOutputReading) || 0 != startSink(&_alertSink, "alerts", &writeAlert)
+        || 0 != startSink(&_aggregateSink, "aggregate", &writeAggregate))
+    {
+        fprintf(stderr, "piook: failed to start sink thread.\n");
+        return 1;
+    }
+
+    int result = replayArchive(_replayFilename, &_replayFrom, &_replayTo);
+    closeSink(&_outputSink);
+    closeSink(&_alertSink);
+    if(0 != _publishedConfig->aggregateIntervalSec || 0 != _publishedConfig->aggregateDeadband) {
+        aggregateTick(_publishedConfig, 1);
+    }
+    closeSink(&_aggregateSink);
+    fflush(stdout);
+    printStats(stderr);
+    return 0 == result ? 0 : 1;
+}
+
+/*===========================================================
+Stage benchmarks (--bench).
+Any stage can run on its own in front of nullStage (see pipeline.h); --bench does that for each
+decode stage in turn over the edges of a recording, and then for the whole decode chain, and
+prints the time per item on stdout. A stage's input is what the stages before it make of the
+recording: it is captured once, by running those stages in front of benchRecorder, so that each
+stage is timed on realistic input without the cost of producing it. Each stage makes repeated
+passes over its input, with the current config (command line and config file), for at least
+__benchMinNs, on the main thread with no other threads running.
+=============================================================*/
+char* _benchFilename = NULL;
+
+// A candidate frame, with its own copy of the decoder buffers that frameBits points into.
+struct benchFrame {
+    frameBits f;
+    int bits[__maxBits+1];
+    unsigned int onDur[__maxBits+1];
+    unsigned int offDur[__maxBits+1];
+};
+
+struct benchValidFrame {
+    uint8_t data[__maxFrameBytes];
+    frameQuality q;
+    uint64_t frameEndNs;
+    uint64_t validatedNs;
+};
+
+// The input of each stage.
+struct benchInput {
+    edgeEvent* edges;
+    int edgeCount;
+    edgeBatch* batches;             // The edges again, as batches (noise spans excluded; see replayArchive()).
+    int batchCount;
+    int batchedEdges;
+    pulseEvent* pulses;
+    int pulseCount;
+    benchFrame* frames;
+    int frameCount;
+    benchValidFrame* validFrames;
+    int validFrameCount;
+};
+
+benchInput _bench;
+
+// Terminal stage that keeps the output of the stages in front of it as the input of the next.
+struct benchRecorder : nullStage {
+    void onPulse(int code, unsigned int duration, const edgeEvent& e)
+    {
+        pulseEvent* p = &_bench.pulses[_bench.pulseCount++];
+        p->code = code;
+        p->duration = duration;
+        p->edge = e;
+    }
+
+    void onFrame(const frameBits& f)
+    {
+        if(_bench.frameCount == __benchMaxFrames) {
+            return;
+        }
+        benchFrame* b = &_bench.frames[_bench.frameCount++];
+        b->f = f;
+        memcpy(b->bits, f.bits, f.count * sizeof(b->bits[0]));
+        memcpy(b->onDur, f.onDur, f.count * sizeof(b->onDur[0]));
+        memcpy(b->offDur, f.offDur, f.count * sizeof(b->offDur[0]));
+        b->f.bits = b->bits;
+        b->f.onDur = b->onDur;
+        b->f.offDur = b->offDur;
+    }
+
+    void onValidFrame(const uint8_t* data, const frameQuality& q, uint64_t frameEndNs, uint64_t validatedNs)
+    {
+        benchValidFrame* v = &_bench.validFrames[_bench.validFrameCount++];
+        memcpy(v->data, data, 5);
+        v->q = q;
+        v->frameEndNs = frameEndNs;
+        v->validatedNs = validatedNs;
+    }
+};
+
+// One pass of a stage over its input.
+template<class Stage>
+static void benchEdges(Stage& s)
+{
+    for(int i=0; i<_bench.edgeCount; i++) {
+        s.onEdge(_bench.edges[i]);
+    }
+}
+
+template<class Stage>
+static void benchBatches(Stage& s)
+{
+    for(int i=0; i<_bench.batchCount; i++) {
+        s.onEdgeBatch(_bench.batches[i]);
+    }
+}
+
+template<class Stage>
+static void benchPulses(Stage& s)
+{
+    for(int i=0; i<_bench.pulseCount; i++) {
+        s.onPulse(_bench.pulses[i].code, _bench.pulses[i].duration, _bench.pulses[i].edge);
+    }
+}
+
+template<class Stage>
+static void benchPulseBatches(Stage& s)
+{
+    for(int i=0; i<_bench.batchCount; i++) {
+        s.onPulseBatch(_bench.batches[i]);
+    }
+}
+
+template<class Stage>
+static void benchFrames(Stage& s)
+{
+    for(int i=0; i<_bench.frameCount; i++) {
+        s.onFrame(_bench.frames[i].f);
+    }
+}
+
+template<class Stage>
+static void benchValidFrames(Stage& s)
+{
+    for(int i=0; i<_bench.validFrameCount; i++) {
+        const benchValidFrame& v = _bench.validFrames[i];
+        s.onValidFrame(v.data, v.q, v.frameEndNs, v.validatedNs);
+    }
+}
+
+// Time passes of a stage over its input (after one to warm up) and print the time per item.
+template<class Stage>
+static void benchStage(const char* name, Stage& s, void (*pass)(Stage&), int items, const char* item)
+{
+    if(0 == items)
+    {
+        printf("%-19s no %ss in the recording\n", name, item);
+        return;
+    }
+    pass(s);
+    uint64_t passes = 0;
+    uint64_t startNs = monotonicNs();
+    uint64_t elapsedNs;
+    do
+    {
+        pass(s);
+        passes++;
+        elapsedNs = monotonicNs() - startNs;
+    }
+    while(elapsedNs < __benchMinNs);
+    double ns = (double)elapsedNs / ((double)passes * items);
+    printf("%-19s %9.1f ns/%-6s %12.0f %ss/s\n", name, ns, item, 1e9 / ns, item);
+}
+
+// Read every edge of a recording into _bench.edges. Returns -1 if it cannot be read.
+static int benchLoad(const char* filename)
+{
+    static archiveReader r;
+    static archiveBlock block;
+    static edgeEvent edges[__archiveBlockEdges];
+    if(0 != openArchive(filename, &r)) {
+        return -1;
+    }
+
+    int cap = 0;
+    for(uint32_t i=0; i<r.blockCount; i++)
+    {
+        int n = 0 == readArchiveBlock(&r, i, &block) ? decodeArchiveBlock(&block, edges) : -1;
+        if(-1 == n)
+        {
+            fprintf(stderr, "piook: skipping corrupt block %u of recording %s.\n", i, filename);
+            continue;
+        }
+        if(_bench.edgeCount + n > cap)
+        {
+            cap = (_bench.edgeCount + n) * 2;
+            edgeEvent* grown = (edgeEvent*)realloc(_bench.edges, cap * sizeof(edgeEvent));
+            if(NULL == grown)
+            {
+                closeArchive(&r);
+                return -1;
+            }
+            _bench.edges = grown;
+        }
+        memcpy(_bench.edges + _bench.edgeCount, edges, n * sizeof(edgeEvent));
+        _bench.edgeCount += n;
+    }
+    closeArchive(&r);
+    return 0;
+}
+
+// Build each stage's input from the recording's edges, by running the stages before it.
+static int benchPrepare(const decoderConfig* c, statBlock* stats)
+{
+    int n = _bench.edgeCount;
+    _bench.batches = (edgeBatch*)calloc(n / __edgeBatchSize + 1, sizeof(edgeBatch));
+    _bench.pulses = (pulseEvent*)malloc((n + 1) * sizeof(pulseEvent));
+    _bench.frames = (benchFrame*)malloc(__benchMaxFrames * sizeof(benchFrame));
+    _bench.validFrames = (benchValidFrame*)malloc(__benchMaxFrames * sizeof(benchValidFrame));
+    if(NULL == _bench.batches || NULL == _bench.pulses || NULL == _bench.frames || NULL == _bench.validFrames) {
+        return -1;
+    }
+
+    for(int i=0; i<n; i++)
+    {
+        const edgeEvent& e = _bench.edges[i];
+        if(0 != e.spanEdges) {
+            continue;
+        }
+        edgeBatch* b = &_bench.batches[_bench.batchCount];
+        b->captureNs[b->count] = e.captureNs;
+        b->timeMu[b->count] = e.timeMu;
+        b->level[b->count] = (uint8_t)e.highLow;
+        _bench.batchedEdges++;
+        if(++b->count == __edgeBatchSize) {
+            _bench.batchCount++;
+        }
+    }
+    if(0 != _bench.batches[_bench.batchCount].count) {
+        _bench.batchCount++;
+    }
+
+    static pulseClassifier<benchRecorder> classifier;
+    classifier.setConfig(c);
+    benchEdges(classifier);
+    classifier.lastTime = 0;
+    benchBatches(classifier);   // Classified in place, for the protocol bank's batch pass.
+
+    static protocolBank<benchRecorder> bank;
+    bank.spawn<cm7Decoder>();
+    bank.setConfig(c);
+    bank.setStats(stats);
+    benchPulses(bank);
+    bank.flush(0 != n ? _bench.edges[n-1].captureNs : 0);
+
+    static frameValidator<benchRecorder> validator;
+    validator.setConfig(c);
+    validator.setStats(stats);
+    benchFrames(validator);
+    return 0;
+}
+
+// Benchmark each decode stage alone, and the decode chain, over a recording (--bench).
+int benchMain()
+{
+    const decoderConfig* c = _publishedConfig;
+    statBlock* stats = allocStatBlock();
+    if(0 != benchLoad(_benchFilename))
+    {
+        fprintf(stderr, "piook: cannot read recording %s.\n", _benchFilename);
+        return 1;
+    }
+    if(NULL == stats || 0 != benchPrepare(c, stats))
+    {
+        fprintf(stderr, "piook: out of memory for the benchmark.\n");
+        return 1;
+    }
+    printf("%s: %d edges, %d pulses, %d frames, %d valid frames; batch classifier kernel %s.\n", _benchFilename,
+        _bench.edgeCount, _bench.pulseCount, _bench.frameCount, _bench.validFrameCount, classifyPulseBatchKernel());
+
+    static glitchFilter<nullStage> glitch;
+    glitch.setStats(stats);
+    glitch.setMinMu(c->glitchFilterMu);
+    benchStage("glitch_filter", glitch, &benchEdges, _bench.edgeCount, "edge");
+
+    static noiseFolder<nullStage> folder;
+    folder.setStats(stats);
+    folder.setWindows(c);
+    benchStage("noise_folder", folder, &benchEdges, _bench.edgeCount, "edge");
+
+    static pulseClassifier<nullStage> classifier;
+    classifier.setConfig(c);
+    benchStage("classifier", classifier, &benchEdges, _bench.edgeCount, "edge");
+    benchStage("classifier_batch", classifier, &benchBatches, _bench.batchedEdges, "edge");
+
+    static protocolBank<nullStage> bank;
+    bank.spawn<cm7Decoder>();
+    bank.setConfig(c);
+    bank.setStats(stats);
+    benchStage("protocol_bank", bank, &benchPulses, _bench.pulseCount, "pulse");
+    benchStage("protocol_bank_batch", bank, &benchPulseBatches, _bench.batchedEdges, "pulse");
+
+    static frameValidator<nullStage> validator;
+    validator.setConfig(c);
+    validator.setStats(stats);
+    benchStage("frame_validator", validator, &benchFrames, _bench.frameCount, "frame");
+
+    static frameParser<nullStage> parser;
+    benchStage("frame_parser", parser, &benchValidFrames, _bench.validFrameCount, "frame");
+
+    static pulseClassifier<protocolBank<frameValidator<frameParser<nullStage> > > > chain;
+    chain.next.spawn<cm7Decoder>();
+    chain.setConfig(c);
+    chain.setStats(stats);
+    benchStage("decode_chain", chain, &benchEdges, _bench.edgeCount, "edge");
+    benchStage("decode_chain_batch", chain, &benchBatches, _bench.batchedEdges, "edge");
+    fflush(stdout);
+    return 0;
+}
+
+/*===========================================================
+Flight recorder (--flight-recorder).
+The last __flightEdges edges seen by the decoder are kept in an in-memory ring that is simply
+overwritten; keeping an edge costs two stores and a store barrier. When something goes wrong,
+the edges around it are dumped to an edge archive (see above) in the flight recorder directory,
+so intermittent failures in the field can be examined (--replay) without recording everything
+all the time. Triggers are a frame rejected for its length or checksum (seen in the decoder's
+counters), and a sensor not heard for __flightSilentIntervals of its transmission interval, i.e.
+a missed transmission. A dump covers __flightPreNs before the trigger (or as much as the ring
+holds) to __flightPostNs after it. Once the post-trigger edges are in, the decoder queues the
+end of the window for a background thread, which copies the window out of the ring, encodes it
+and writes it; the decoder never copies. Each reason triggers at most one dump per
+__flightMinIntervalSec. Up to __flightQueueLen dumps wait while one is written; a trigger beyond
+that is dropped, counted, and reported on stderr by the dump thread.
+=============================================================*/
+const double __flightSilentIntervals = 1.25;
+const int __flightQueueLen = 4;
+const char* __flightReasonNames[FLIGHT_REASON_COUNT] = { "none", "bad_length", "bad_crc", "sensor_silent" };
+
+char* _flightDir = NULL;
+statBlock* _decoderStats = NULL;
+
+// Written by the decoder thread, copied from by the dump thread (see flightRecordEdge()).
+edgeEvent _flightRing[__flightEdges];
+unsigned int _flightHead = 0;
+
+// Decoder thread.
+uint64_t _flightBadLength = 0;                      // Decoder counters at the last edge.
+uint64_t _flightBadCrc = 0;
+int _flightPending[FLIGHT_REASON_COUNT];            // Triggers waiting for their post-trigger edges.
+uint64_t _flightPendingNs[FLIGHT_REASON_COUNT];
+int _flightPendingCount = 0;
+uint64_t _flightLastTriggerNs[FLIGHT_REASON_COUNT];
+
+// Posted by the event loop thread (sensor silent) for the decoder thread.
+int _flightPostedReason = FLIGHT_NONE;
+uint64_t _flightPostedNs = 0;
+uint64_t _flightSilentHeardNs[__maxSensors];    // Event loop thread; lastHeardNs of each sensor's last silence trigger.
+
+// Queued by the decoder thread for the dump thread.
+flightRequest _flightQueue[__flightQueueLen];
+unsigned int _flightQueueHead = 0;              // Decoder thread.
+unsigned int _flightQueueTail = 0;              // Dump thread.
+int _flightStop = 0;
+sem_t _flightDumpSem;
+pthread_t _flightDumpThreadId;
+uint64_t _flightDumpsDropped = 0;
+
+// Dump thread.
+edgeEvent _flightDump[__flightEdges];
+
+int startFlightRecorder()
+{
+    sem_init(&_flightDumpSem, 0, 0);
+    return pthread_create(&_flightDumpThreadId, NULL, &flightDumpThread, NULL);
+}
+
+// Queue the dump of a trigger's window, which ends with the edge before ring index end.
+static void flightQueueDump(int reason, uint64_t triggerNs, unsigned int end)
+{
+    unsigned int head = _flightQueueHead;
+    if(head - __atomic_load_n(&_flightQueueTail, __ATOMIC_ACQUIRE) >= (unsigned int)__flightQueueLen)
+    {
+        __atomic_store_n(&_flightDumpsDropped, _flightDumpsDropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    flightRequest* q = &_flightQueue[head % __flightQueueLen];
+    q->reason = reason;
+    q->triggerNs = triggerNs;
+    q->end = end;
+    __atomic_store_n(&_flightQueueHead, head + 1, __ATOMIC_RELEASE);
+    sem_post(&_flightDumpSem);
+}
+
+static void flightTrigger(int reason, uint64_t triggerNs)
+{
+    if(!_flightPending[reason]
+        && (0 == _flightLastTriggerNs[reason] || triggerNs - _flightLastTriggerNs[reason] >= __flightMinIntervalSec * 1000000000ULL))
+    {
+        _flightPending[reason] = 1;
+        _flightPendingNs[reason] = triggerNs;
+        _flightLastTriggerNs[reason] = triggerNs;
+        _flightPendingCount++;
+    }
+}
+
+// Decoder thread; called with each edge after it has been decoded.
+void flightRecordEdge(const edgeEvent& e)
+{
+    // The head moves on before the slot it reuses is overwritten, so that the dump thread can tell
+    // which of the edges it copied may have been overwritten meanwhile (see flightCopy()).
+    unsigned int head = _flightHead;
+    __atomic_store_n(&_flightHead, head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    _flightRing[head & (__flightEdges - 1)] = e;
+
+    uint64_t badLength = _decoderStats->counts[STAT_BAD_LENGTH];
+    uint64_t badCrc = _decoderStats->counts[STAT_BAD_CRC];
+    if(badLength != _flightBadLength) {
+        flightTrigger(FLIGHT_BAD_LENGTH, e.captureNs);
+    }
+    if(badCrc != _flightBadCrc) {
+        flightTrigger(FLIGHT_BAD_CRC, e.captureNs);
+    }
+    _flightBadLength = badLength;
+    _flightBadCrc = badCrc;
+    if(FLIGHT_NONE != __atomic_load_n(&_flightPostedReason, __ATOMIC_ACQUIRE))
+    {
+        uint64_t triggerNs = _flightPostedNs;
+        flightTrigger(__atomic_exchange_n(&_flightPostedReason, (int)FLIGHT_NONE, __ATOMIC_ACQ_REL), triggerNs);
+    }
+
+    if(0 == _flightPendingCount) {
+        return;
+    }
+    for(int reason=FLIGHT_NONE+1; reason<FLIGHT_REASON_COUNT; reason++)
+    {
+        if(_flightPending[reason] && e.captureNs >= _flightPendingNs[reason] + __flightPostNs)
+        {
+            flightQueueDump(reason, _flightPendingNs[reason], head + 1);
+            _flightPending[reason] = 0;
+            _flightPendingCount--;
+        }
+    }
+}
+
+// Event loop thread, once a tick; trigger on a missed transmission, once per silence.
+void flightRecorderTick(uint64_t nowNs)
+{
+    int sensorCount = __atomic_load_n(&_sensorCount, __ATOMIC_ACQUIRE);
+    for(int i=0; i<sensorCount; i++)
+    {
+        uint64_t heardNs = __atomic_load_n(&_sensors[i].lastHeardNs, __ATOMIC_RELAXED);
+        if(nowNs - heardNs > (uint64_t)(__flightSilentIntervals * __sensorIntervalSec * 1000000000ULL)
+            && heardNs != _flightSilentHeardNs[i] && FLIGHT_NONE == __atomic_load_n(&_flightPostedReason, __ATOMIC_ACQUIRE))
+        {
+            _flightSilentHeardNs[i] = heardNs;
+            _flightPostedNs = nowNs;
+            __atomic_store_n(&_flightPostedReason, (int)FLIGHT_SENSOR_SILENT, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Decoder thread, at shutdown; dump the triggers still waiting for their post-trigger edges, and wait for the dumps.
+void closeFlightRecorder()
+{
+    for(int reason=FLIGHT_NONE+1; reason<FLIGHT_REASON_COUNT; reason++)
+    {
+        if(_flightPending[reason]) {
+            flightQueueDump(reason, _flightPendingNs[reason], _flightHead);
+        }
+    }
+    __atomic_store_n(&_flightStop, 1, __ATOMIC_RELEASE);
+    sem_post(&_flightDumpSem);
+    pthread_join(_flightDumpThreadId, NULL);
+}
+
+// Dump thread; copy a request's window out of the ring into _flightDump, oldest edge first, and return
+// the number of edges. The decoder goes on overwriting the oldest edges meanwhile; any copied from slots
+// that it has since moved its head past (see flightRecordEdge()) are discarded, shortening the window.
+static int flightCopy(const flightRequest* q, const edgeEvent** edges)
+{
+    uint64_t startNs = q->triggerNs > __flightPreNs ? q->triggerNs - __flightPreNs : 0;
+    unsigned int held = q->end < (unsigned int)__flightEdges ? q->end : __flightEdges;
+    unsigned int n = 0;
+    while(n < held && _flightRing[(q->end - 1 - n) & (__flightEdges - 1)].captureNs >= startNs) {
+        n++;
+    }
+    unsigned int first = q->end - n;
+    for(unsigned int i=0; i<n; i++) {
+        _flightDump[i] = _flightRing[(first + i) & (__flightEdges - 1)];
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    int overwritten = (int)(__atomic_load_n(&_flightHead, __ATOMIC_RELAXED) - __flightEdges - first);
+    if(overwritten < 0) {
+        overwritten = 0;
+    }
+    if(overwritten > (int)n) {
+        overwritten = n;
+    }
+    *edges = _flightDump + overwritten;
+    return n - overwritten;
+}
+
+void* flightDumpThread(void*)
+{
+    uint64_t droppedReported = 0;
+    for(;;)
+    {
+        if(0 != sem_wait(&_flightDumpSem)) {
+            continue;   // EINTR.
+        }
+        unsigned int tail = _flightQueueTail;
+        if(tail == __atomic_load_n(&_flightQueueHead, __ATOMIC_ACQUIRE))
+        {
+            if(__atomic_load_n(&_flightStop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+        flightRequest q = _flightQueue[tail % __flightQueueLen];
+        const edgeEvent* edges;
+        int n = flightCopy(&q, &edges);
+        __atomic_store_n(&_flightQueueTail, tail + 1, __ATOMIC_RELEASE);
+
+        // Name the dump after the trigger's wall clock time.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        time_t triggerUnix = now.tv_sec - (time_t)((monotonicNs() - q.triggerNs) / 1000000000ULL);
+        struct tm tm;
+        localtime_r(&triggerUnix, &tm);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+        char path[1100];
+        snprintf(path, sizeof(path), "%s/flight-%s-%s.rec", _flightDir, stamp, __flightReasonNames[q.reason]);
+
+        if(0 == n) {
+            fprintf(stderr, "piook: flight recorder dump %s skipped; its edges were overwritten.\n", path);
+        }
+        else if(0 == writeArchiveFile(path, edges, n)) {
+            fprintf(stderr, "piook: flight recorder dump %s (%d edges).\n", path, n);
+        }
+        else {
+            fprintf(stderr, "piook: failed to write flight recorder dump %s.\n", path);
+        }
+
+        uint64_t dropped = __atomic_load_n(&_flightDumpsDropped, __ATOMIC_RELAXED);
+        if(dropped != droppedReported)
+        {
+            fprintf(stderr, "piook: flight recorder dropped %llu trigger(s); dump queue full.\n", (unsigned long long)(dropped - droppedReported));
+            droppedReported = dropped;
+        }
+    }
+    return NULL;
+}
+
+/*===========================================================
+Near-miss log (near_miss).
+A frame rejected for its length or checksum is evidence of what went wrong: a single bit on the
+edge of its timing window, a truncated transmission, a transmitter whose timing has drifted. With
+near_miss on, each rejected frame is appended to outfile.nearmiss as a binary record (see
+nearMissHeader) with its bits, the bytes as received, and every pulse duration with its margin to
+the timing window, for offline tools to cluster the causes and to tune the timing windows and soft
+decoding. The decoder thread fills in a record and queues it; the event loop appends the queued
+records once a tick, so the decoder never waits on the file. Records are rate limited with a token
+bucket on the frames' capture times (a burst of __nearMissBurst, then one per __nearMissIntervalSec),
+so that a noisy band or a neighbour's transmitter cannot fill the disk; frames over the limit, or
+that find the queue full, are counted (near_miss_dropped) but not logged.
+=============================================================*/
+
+// Decoder thread.
+nearMissRecord _nearMiss[__nearMissSlots];
+unsigned int _nearMissHead = 0;
+uint64_t _nearMissCreditNs = __nearMissBurst * __nearMissIntervalSec * 1000000000ULL;
+uint64_t _nearMissLastNs = 0;
+
+// Event loop thread (or the decoder thread, when replaying or at shutdown).
+unsigned int _nearMissTail = 0;
+
+// Decoder thread; queue a record of a rejected frame.
+void logNearMiss(const decoderConfig* c, const frameBits& f, int reason, const uint8_t* data, int dataLen)
+{
+    // Rate limit.
+    const uint64_t intervalNs = __nearMissIntervalSec * 1000000000ULL;
+    const uint64_t burstNs = __nearMissBurst * intervalNs;
+    if(0 != _nearMissLastNs)
+    {
+        uint64_t elapsed = f.frameEndNs - _nearMissLastNs;
+        _nearMissCreditNs = elapsed < burstNs - _nearMissCreditNs ? _nearMissCreditNs + elapsed : burstNs;
+    }
+    _nearMissLastNs = f.frameEndNs;
+    unsigned int head = _nearMissHead;
+    if(_nearMissCreditNs < intervalNs || head - __atomic_load_n(&_nearMissTail, __ATOMIC_ACQUIRE) >= (unsigned int)__nearMissSlots)
+    {
+        statInc(STAT_NEAR_MISS_DROPPED);
+        return;
+    }
+    _nearMissCreditNs -= intervalNs;
+
+    nearMissRecord* rec = &_nearMiss[head % __nearMissSlots];
+    nearMissHeader* h = &rec->header;
+    memset(h, 0, sizeof(*h));
+    int count = f.count < __maxBits ? f.count : __maxBits;
+    h->magic = __nearMissMagic;
+    h->version = __nearMissVersion;
+    h->size = sizeof(nearMissHeader) + count * sizeof(nearMissPulse);
+    h->unixNs = captureUnixNs(f.frameEndNs);
+    h->frameEndNs = f.frameEndNs;
+    h->reason = STAT_BAD_LENGTH == reason ? NEAR_MISS_BAD_LENGTH : NEAR_MISS_BAD_CRC;
+    h->pulseCount = count;
+    h->dataLen = dataLen < (int)sizeof(h->data) ? dataLen : sizeof(h->data);
+    h->softDecode = STAT_BAD_CRC == reason && c->softDecode;
+    h->onMu = c->onMu;
+    h->offShortMu = c->offShortMu;
+    h->offLongMu = c->offLongMu;
+    h->jitterMu = c->jitterWindow;
+    h->noiseBefore = f.noiseBefore < 0xFFFF ? f.noiseBefore : 0xFFFF;
+    memcpy(h->data, data, h->dataLen);
+    for(int i=0; i<count; i++)
+    {
+        if(1 == f.bits[i]) {
+            h->bits[i / 8] |= 0x80 >> (i % 8);
+        }
+        nearMissPulse* p = &rec->pulses[i];
+        p->onMu = f.onDur[i] < 0xFFFF ? f.onDur[i] : 0xFFFF;
+        p->offMu = f.offDur[i] < 0xFFFF ? f.offDur[i] : 0xFFFF;
+        p->onMarginMu = pulseMargin(c, 3, f.onDur[i]);
+        p->offMarginMu = pulseMargin(c, f.bits[i], f.offDur[i]);
+    }
+    __atomic_store_n(&_nearMissHead, head + 1, __ATOMIC_RELEASE);
+    statInc(STAT_NEAR_MISS_LOGGED);
+
+    // Replay has no event loop; the decoder appends its own records.
+    if(NULL != _replayFilename) {
+        nearMissTick(c);
+    }
+}
+
+// Append the queued records to outfile.nearmiss, in one write. (validateConfig() requires an output file for
+// near_miss; records queued under a config without one are discarded.)
+void nearMissTick(const decoderConfig* c)
+{
+    static char buf[__nearMissSlots * sizeof(nearMissRecord)];
+    unsigned int tail = _nearMissTail;
+    unsigned int head = __atomic_load_n(&_nearMissHead, __ATOMIC_ACQUIRE);
+    if(tail == head) {
+        return;
+    }
+    int len = 0;
+    for(; tail != head; tail++)
+    {
+        const nearMissRecord* rec = &_nearMiss[tail % __nearMissSlots];
+        memcpy(buf + len, rec, rec->header.size);
+        len += rec->header.size;
+    }
+    __atomic_store_n(&_nearMissTail, tail, __ATOMIC_RELEASE);
+
+    if(0 != c->outfilename[0])
+    {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s.nearmiss", c->outfilename);
+        if(0 != appendFile(path, buf, len)) {
+            fprintf(stderr, "piook: failed to write %s.\n", path);
+        }
+    }
+}
+
+/*===========================================================
+Reject/drop accounting.
+Each thread that handles edges or frames increments counters in its own statBlock, hence the
+hot path is a thread local load and store with no locking or shared cache lines. The blocks
+are summed on demand (SIGUSR1) by reading each block's counters with relaxed atomic loads.
+=============================================================*/
+const int __maxStatBlocks = 8;
+statBlock _statBlocks[__maxStatBlocks];
+int _statBlockCount = 0;
+__thread statBlock* _tlsStats = NULL;
+
+// Fallback block shared by any threads beyond __maxStatBlocks (counts remain approximately correct).
+statBlock _overflowStats;
+
+// A block for a single writer, e.g. a pipeline.
+statBlock* allocStatBlock()
+{
+    int idx = __atomic_fetch_add(&_statBlockCount, 1, __ATOMIC_RELAXED);
+    return idx < __maxStatBlocks ? &_statBlocks[idx] : &_overflowStats;
+}
+
+// Bind a block to the calling thread.
+statBlock* registerStatBlock()
+{
+    _tlsStats = allocStatBlock();
+    return _tlsStats;
+}
+
+void statsSnapshot(uint64_t* counts)
+{
+    int blockCount = __atomic_load_n(&_statBlockCount, __ATOMIC_RELAXED);
+    if(blockCount > __maxStatBlocks) {
+        blockCount = __maxStatBlocks;
+    }
+
+    for(int i=0; i<STAT_COUNT; i++) {
+        counts[i] = __atomic_load_n(&_overflowStats.counts[i], __ATOMIC_RELAXED);
+    }
+
+    for(int b=0; b<blockCount; b++)
+    {
+        for(int i=0; i<STAT_COUNT; i++) {
+            counts[i] += __atomic_load_n(&_statBlocks[b].counts[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void printStats(FILE* f)
+{
+    uint64_t counts[STAT_COUNT];
+    statsSnapshot(counts);
+
+    fprintf(f, "piook stats:");
+    for(int i=0; i<STAT_COUNT; i++) {
+        fprintf(f, " %s=%llu", __statNames[i], (unsigned long long)counts[i]);
+    }
+    fprintf(f, "\n");
+    fflush(f);
+}
+
+/*===========================================================
+Per-stage latency histograms.
+Log-linear buckets (HdrHistogram style); each power of two range is split into 16 linear
+sub-buckets, giving a worst case relative error of ~6% over the full 64 bit range of
+nanosecond values. Each histogram has a single writing thread, so recording is a relaxed
+load/store on one bucket; snapshots copy the buckets with relaxed loads and so never pause
+recording (a snapshot may be very slightly torn, which is fine for latency reporting).
+=============================================================*/
+const char* __histNames[HIST_COUNT] = {
+    "capture_to_dequeue",
+    "frame_to_validated",
+    "validated_to_sink",
+    "wake_latency"
+};
+
+latencyHist _hists[HIST_COUNT];
+
+int histBucketIndex(uint64_t value)
+{
+    if(value < __histSubBuckets) {
+        return (int)value;
+    }
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - __histSubBits + 1) * __histSubBuckets + (int)((value >> (exp - __histSubBits)) & (__histSubBuckets - 1));
+}
+
+// Highest value that maps to the given bucket.
+uint64_t histBucketUpperValue(int idx)
+{
+    if(idx < __histSubBuckets) {
+        return idx;
+    }
+    int exp = idx / __histSubBuckets + __histSubBits - 1;
+    uint64_t sub = __histSubBuckets + (idx % __histSubBuckets);
+    return ((sub + 1) << (exp - __histSubBits)) - 1;
+}
+
+void histRecord(histId id, uint64_t valueNs)
+{
+    latencyHist* h = &_hists[id];
+    int idx = histBucketIndex(valueNs);
+    __atomic_store_n(&h->counts[idx], h->counts[idx] + 1, __ATOMIC_RELAXED);
+    if(valueNs > h->max) {
+        __atomic_store_n(&h->max, valueNs, __ATOMIC_RELAXED);
+    }
+}
+
+void histSnapshot(histId id, latencyHist* out)
+{
+    latencyHist* h = &_hists[id];
+    for(int i=0; i<__histBucketCount; i++) {
+        out->counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+    out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+uint64_t histPercentile(const latencyHist* h, uint64_t total, double pct)
+{
+    uint64_t target = (uint64_t)(total * pct / 100.0);
+    uint64_t seen = 0;
+    for(int i=0; i<__histBucketCount; i++)
+    {
+        seen += h->counts[i];
+        if(seen > target) {
+            return histBucketUpperValue(i) < h->max ? histBucketUpperValue(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+void printHistograms(FILE* f)
+{
+    // Static because a snapshot is ~8KB; only ever called from the main thread.
+    static latencyHist snap;
+
+    for(int id=0; id<HIST_COUNT; id++)
+    {
+        histSnapshot((histId)id, &snap);
+        uint64_t total = 0;
+        for(int i=0; i<__histBucketCount; i++) {
+            total += snap.counts[i];
+        }
+
+        fprintf(f, "piook latency %s (us): count=%llu", __histNames[id], (unsigned long long)total);
+        if(0 != total)
+        {
+            fprintf(f, " p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f",
+                histPercentile(&snap, total, 50.0) / 1000.0,
+                histPercentile(&snap, total, 90.0) / 1000.0,
+                histPercentile(&snap, total, 99.0) / 1000.0,
+                histPercentile(&snap, total, 99.9) / 1000.0,
+                snap.max / 1000.0);
+        }
+        fprintf(f, "\n");
+    }
+    fflush(f);
+}
+
+/*===========================================================
+Sampling self-profiler (--profile).
+Each thread notes which stage it is entering at stage boundaries (profSwitch); the boundary is
+timestamped with CLOCK_MONOTONIC (a vDSO call, no syscall) and the time since the previous
+boundary is added to the stage being left, hence one clock read per boundary. Time spent idle
+(waiting for edges) is not accumulated. Each stage accumulator has a single writing thread.
+When profiling is off the only cost is a test of _profile at each boundary. The main loop periodically reports each stage's share of
+wall clock time, which for these CPU bound stages is their share of a CPU.
+=============================================================*/
+const char* __profStageNames[PROF_COUNT] = {
+    "capture",
+    "classify",
+    "preamble",
+    "frame_build",
+    "crc",
+    "parse",
+    "format",
+    "sink_io"
+};
+
+void printProfile(FILE* f)
+{
+    static uint64_t lastNs = 0;
+    static uint64_t lastProfNs[PROF_COUNT];
+    static uint64_t lastEdges = 0;
+    static uint64_t lastReadings = 0;
+
+    uint64_t nowNs = monotonicNs();
+    uint64_t counts[STAT_COUNT];
+    statsSnapshot(counts);
+
+    if(0 != lastNs)
+    {
+        double elapsedNs = (double)(nowNs - lastNs);
+        double secs = elapsedNs / 1e9;
+        fprintf(f, "piook profile: edges/s=%.1f readings/s=%.3f",
+            (counts[STAT_EDGES] - lastEdges) / secs,
+            (counts[STAT_FRAMES_OK] - lastReadings) / secs);
+
+        for(int i=0; i<PROF_COUNT; i++)
+        {
+            uint64_t ns = __atomic_load_n(&_profNs[i], __ATOMIC_RELAXED);
+            fprintf(f, " %s=%.3f%%", __profStageNames[i], 100.0 * (ns - lastProfNs[i]) / elapsedNs);
+        }
+        fprintf(f, "\n");
+        fflush(f);
+    }
+
+    lastNs = nowNs;
+    for(int i=0; i<PROF_COUNT; i++) {
+        lastProfNs[i] = __atomic_load_n(&_profNs[i], __ATOMIC_RELAXED);
+    }
+    lastEdges = counts[STAT_EDGES];
+    lastReadings = counts[STAT_FRAMES_OK];
+}
+
+/*===========================================================
+Edge capture ring.
+The interrupt handler only records the edge time and pin level and pushes them onto a single
+producer/single consumer ring; all decoding happens on the decoder thread. wiringPi calls the
+handler from a single thread, so there is exactly one producer, and the decoder thread is the
+only consumer. The semaphore is posted for each push (an edge, or a batch from polling capture)
+so that the decoder sleeps when idle; each wake takes every edge then queued.
+=============================================================*/
+const unsigned int __edgeRingSize = 1024;    // Must be a power of two.
+edgeEvent _edgeRing[__edgeRingSize];
+unsigned int _edgeRingHead = 0;             // Written by the capture thread only.
+unsigned int _edgeRingTail = 0;             // Written by the decoder thread only.
+sem_t _edgeRingSem;
+
+// Give each pipeline its own stat block. The capture pipeline has one writer at a time (the
+// active capture source), and the decode pipeline only runs on the decoder thread.
+void initPipelines()
+{
+    _decoder.next.spawn<cm7Decoder>();
+    _capture.setStats(allocStatBlock());
+    _decoderStats = allocStatBlock();
+    _decoder.setStats(_decoderStats);
+}
+
+// Capture source currently feeding the ring (see watchdog storm mitigation).
+int _captureMode = CAPTURE_IRQ;
+
+void handleInterrupt() 
+{
+    if(CAPTURE_IRQ != __atomic_load_n(&_captureMode, __ATOMIC_RELAXED)) {
+        return;     // Polling capture has taken over (or is taking over).
+    }
+
+    // Get current time and IO pin level.
+    uint64_t captureNs = monotonicNs();
+    profSwitchAt(PROF_CAPTURE, captureNs);
+    unsigned int time = micros();
+    int highLow = digitalRead(_pinNum);
+    HOT_PATH_ENTER();
+    captureEdge(time, highLow, captureNs);
+    HOT_PATH_EXIT();
+    profSwitch(PROF_IDLE);
+}
+
+// Pass an edge through the capture pipeline. Called by whichever capture source is active, never two at once.
+void captureEdge(unsigned int time, int highLow, uint64_t captureNs)
+{
+    statInc(STAT_EDGES);
+    PIOOK_PROBE3(edge_captured, captureNs, time, highLow);
+
+    edgeEvent e;
+    e.captureNs = captureNs;
+    e.timeMu = time;
+    e.highLow = highLow;
+    e.spanMu = 0;
+    e.spanEdges = 0;
+    _capture.onEdge(e);
+}
+
+// As captureEdge(), for a batch of edges (from polling capture).
+void captureEdgeBatch(edgeBatch& b)
+{
+    statAdd(STAT_EDGES, b.count);
+#ifdef PIOOK_HAVE_SDT
+    for(int i=0; i<b.count; i++) {
+        PIOOK_PROBE3(edge_captured, b.captureNs[i], b.timeMu[i], b.level[i]);
+    }
+#endif
+    _capture.onEdgeBatch(b);
+}
+
+// Push an edge onto the ring (the capture pipeline's final stage).
+void pushEdge(const edgeEvent& edge)
+{
+    unsigned int head = _edgeRingHead;
+    if(head - __atomic_load_n(&_edgeRingTail, __ATOMIC_ACQUIRE) >= __edgeRingSize)
+    {   // Decoder is not keeping up; drop the edge.
+        statInc(STAT_RING_OVERFLOW);
+        return;
+    }
+
+    _edgeRing[head & (__edgeRingSize - 1)] = edge;
+    __atomic_store_n(&_edgeRingHead, head + 1, __ATOMIC_RELEASE);
+    sem_post(&_edgeRingSem);
+}
+
+// As pushEdge(), for a batch; the ring head is released, and the decoder woken, once for the lot.
+// The edges that do not fit are dropped.
+void pushEdges(const edgeBatch& b)
+{
+    unsigned int head = _edgeRingHead;
+    unsigned int room = __edgeRingSize - (head - __atomic_load_n(&_edgeRingTail, __ATOMIC_ACQUIRE));
+    int n = (unsigned int)b.count < room ? b.count : (int)room;
+    if(n < b.count) {
+        statAdd(STAT_RING_OVERFLOW, b.count - n);
+    }
+    if(0 == n) {
+        return;
+    }
+
+    for(int i=0; i<n; i++)
+    {
+        edgeEvent& e = _edgeRing[(head + i) & (__edgeRingSize - 1)];
+        e.captureNs = b.captureNs[i];
+        e.timeMu = b.timeMu[i];
+        e.highLow = b.level[i];
+        e.spanMu = 0;
+        e.spanEdges = 0;
+    }
+    __atomic_store_n(&_edgeRingHead, head + n, __ATOMIC_RELEASE);
+    sem_post(&_edgeRingSem);
+}
+
+// Polling capture; samples the pin level rather than taking an interrupt per edge, which bounds the
+// capture cost during interrupt storms. Idle unless the watchdog has switched capture to polling.
+// Edges are passed through the capture pipeline in batches, when a batch is full, __pollBatchNs after
+// its first edge, or when polling stops (well within the capture switch's grace period, so the ring
+// still has one producer).
+const long __pollIntervalNs = 50000;
+const uint64_t __pollBatchNs = 2000000;
+
+void* pollCaptureThread(void*)
+{
+    static edgeBatch batch;
+
+    struct timespec pollTim;
+    pollTim.tv_sec = 0;
+    pollTim.tv_nsec = __pollIntervalNs;
+
+    struct timespec idleTim;
+    idleTim.tv_sec = 0;
+    idleTim.tv_nsec = 100000000L;
+
+    int lastLevel = -1;
+    batch.count = 0;
+    for(;;)
+    {
+        int polling = CAPTURE_POLL == __atomic_load_n(&_captureMode, __ATOMIC_RELAXED);
+        int level = polling ? digitalRead(_pinNum) : -1;
+        uint64_t nowNs = polling && (level != lastLevel || 0 != batch.count) ? monotonicNs() : 0;
+        if(polling && level != lastLevel)
+        {
+            if(-1 != lastLevel)
+            {
+                batch.captureNs[batch.count] = nowNs;
+                batch.timeMu[batch.count] = micros();
+                batch.level[batch.count] = (uint8_t)level;
+                batch.count++;
+            }
+            lastLevel = level;
+        }
+        if(0 != batch.count && (!polling || __edgeBatchSize == batch.count || nowNs - batch.captureNs[0] >= __pollBatchNs))
+        {
+            profSwitch(PROF_CAPTURE);
+            HOT_PATH_ENTER();
+            captureEdgeBatch(batch);
+            HOT_PATH_EXIT();
+            batch.count = 0;
+            profSwitch(PROF_IDLE);
+        }
+
+        if(!polling)
+        {
+            lastLevel = -1;
+            nanosleep(&idleTim, NULL);
+            continue;
+        }
+        nanosleep(&pollTim, NULL);
+    }
+    return NULL;
+}
+
+// Set (once capture has stopped) to have the decoder drain the ring, decode any frame in progress, and exit.
+int _decoderShutdown = 0;
+
+// A new config is adopted between frames, i.e. before an edge or batch that finds the decoder idle.
+static void decodeBatch(edgeBatch& b)
+{
+    if(_decoder.idle()) {
+        decoderConfigCheckpoint();
+    }
+    _decoder.onEdgeBatch(b);
+    b.count = 0;
+}
+
+// Pass edges through the decode pipeline, in batches (see pulseClassifier::onEdgeBatch()); noise spans are
+// passed on singly. Called on the decoder thread (or by replayArchive()) only, in edge order.
+void decodeEdges(const edgeEvent* edges, int n)
+{
+    static edgeBatch batch;
+    batch.count = 0;
+    for(int i=0; i<n; i++)
+    {
+        const edgeEvent& e = edges[i];
+        if(0 != e.spanEdges)
+        {
+            if(0 != batch.count) {
+                decodeBatch(batch);
+            }
+            if(_decoder.idle()) {
+                decoderConfigCheckpoint();
+            }
+            _decoder.onEdge(e);
+            continue;
+        }
+        batch.captureNs[batch.count] = e.captureNs;
+        batch.timeMu[batch.count] = e.timeMu;
+        batch.level[batch.count] = (uint8_t)e.highLow;
+        if(++batch.count == __edgeBatchSize) {
+            decodeBatch(batch);
+        }
+    }
+    if(0 != batch.count) {
+        decodeBatch(batch);
+    }
+}
+
+void* decoderThread(void*)
+{
+    decoderConfigCheckpoint();
+    for(;;)
+    {
+        profSwitch(PROF_IDLE);
+        if(0 != sem_wait(&_edgeRingSem)) {
+            continue;   // EINTR.
+        }
+        profSwitch(PROF_CLASSIFY);
+
+        // Each wake takes every queued edge, so a wake may find none: the edges of a post already taken,
+        // or none at all at shutdown. The edges are decoded in place and only then released to capture.
+        unsigned int tail = _edgeRingTail;
+        unsigned int head = __atomic_load_n(&_edgeRingHead, __ATOMIC_ACQUIRE);
+        if(tail == head)
+        {
+            if(__atomic_load_n(&_decoderShutdown, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t dequeueNs = monotonicNs();
+        while(tail != head)
+        {
+            const edgeEvent* edges = &_edgeRing[tail & (__edgeRingSize - 1)];
+            int n = (int)(head - tail);
+            if(n > (int)(__edgeRingSize - (tail & (__edgeRingSize - 1)))) {
+                n = (int)(__edgeRingSize - (tail & (__edgeRingSize - 1)));    // Up to the end of the ring.
+            }
+
+            HOT_PATH_ENTER();
+            for(int i=0; i<n; i++)
+            {
+                histRecord(HIST_CAPTURE_TO_DEQUEUE, dequeueNs - edges[i].captureNs);
+                if(NULL != _recordFilename) {
+                    recordEdge(&_recording, edges[i]);
+                }
+            }
+            decodeEdges(edges, n);
+            if(NULL != _flightDir)
+            {   // After the decode, so a trigger (from the decoder's counters) is seen at the first edge of the lot.
+                for(int i=0; i<n; i++) {
+                    flightRecordEdge(edges[i]);
+                }
+            }
+            HOT_PATH_EXIT();
+
+            tail += n;
+            __atomic_store_n(&_edgeRingTail, tail, __ATOMIC_RELEASE);
+        }
+        if(__atomic_load_n(&_decoderShutdown, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&_edgeRingHead, __ATOMIC_ACQUIRE)) {
+            break;      // Capture has stopped, so nothing more can be queued.
+        }
+    }
+
+    // Decode the frame in progress, if any; normally this waits for the noise that follows a transmission.
+    _decoder.flush(monotonicNs());
+    if(NULL != _recordFilename) {
+        closeRecording(&_recording);
+    }
+    if(NULL != _flightDir) {
+        closeFlightRecorder();
+    }
+    // The event loop stops its ticks at shutdown, so the queued near misses are left to the decoder.
+    nearMissTick(__atomic_load_n(&_publishedConfig, __ATOMIC_ACQUIRE));
+
+    // Write out the queued readings, alerts and aggregates (including those of the interval in progress).
+    closeSink(&_outputSink);
+    closeSink(&_alertSink);
+    decoderConfig* c = __atomic_load_n(&_publishedConfig, __ATOMIC_ACQUIRE);
+    if(0 != c->aggregateIntervalSec || 0 != c->aggregateDeadband) {
+        aggregateTick(c, 1);
+    }
+    closeSink(&_aggregateSink);
+
+    uint64_t one = 1;
+    if(sizeof(one) != write(_decoderDoneFd, &one, sizeof(one))) {
+        fprintf(stderr, "piook: failed to signal decoder exit.\n");
+    }
+    return NULL;
+}
+
+/*===========================================================
+Sink queues.
+The decoder thread never writes output itself; each sink (currently just the output file or
+stdout) has a bounded queue and its own thread, so a slow sink (SD card, a stalled pipe) cannot
+stall decoding, and hence capture. When a queue is full the sink's policy decides what gives:
+drop the oldest or the newest reading, coalesce with a queued reading from the same sensor, or
+(offline decoding only) wait. The queue lock is only ever held to copy one reading in or out.
+The policy and queue length are read from the decoder's config on each enqueue, so both reload.
+Sink threads read the published config directly and protect it from reclamation with a hazard
+pointer (cfgInUse); see serviceConfigReload().
+=============================================================*/
+const char* __sinkPolicyNames[SINK_POLICY_COUNT] = { "drop_oldest", "drop_newest", "coalesce", "block" };
+const char* __sinkCounterNames[SINK_COUNTER_COUNT] = {
+    "enqueued",
+    "written",
+    "dropped_oldest",
+    "dropped_newest",
+    "coalesced",
+    "blocked",
+    "max_depth"
+};
+
+sinkQueue _outputSink;
+sinkQueue* _sinks[__maxSinks];
+int _sinkCount = 0;
+
+int parseSinkPolicy(const char* name)
+{
+    for(int i=0; i<SINK_POLICY_COUNT; i++)
+    {
+        if(0 == strcmp(name, __sinkPolicyNames[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int startSink(sinkQueue* q, const char* name, void (*write)(const reading& r))
+{
+    memset(q, 0, sizeof(*q));
+    q->name = name;
+    q->write = write;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+    if(_sinkCount >= __maxSinks || 0 != pthread_create(&q->thread, NULL, &sinkThread, q)) {
+        return -1;
+    }
+    _sinks[_sinkCount++] = q;
+    return 0;
+}
+
+// Counters have a single writer each (the producer or the sink thread), hence relaxed load/store.
+static inline void sinkCount(sinkQueue* q, sinkCounter id)
+{
+    __atomic_store_n(&q->counters[id], q->counters[id] + 1, __ATOMIC_RELAXED);
+}
+
+// Producer side (the decoder thread).
+void sinkEnqueue(sinkQueue* q, const reading& r, int policy, int capacity)
+{
+    if(capacity < 1) {
+        capacity = 1;
+    }
+    else if(capacity > __sinkQueueMax) {
+        capacity = __sinkQueueMax;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if(SINK_COALESCE == policy)
+    {
+        for(int i=0; i<q->count; i++)
+        {
+            reading* queued = &q->items[(q->head + i) % __sinkQueueMax];
+            if(queued->sensorId == r.sensorId)
+            {
+                *queued = r;
+                sinkCount(q, SINK_COALESCED);
+                pthread_mutex_unlock(&q->lock);
+                return;
+            }
+        }
+    }
+
+    int blocked = 0;
+    while(q->count >= capacity)
+    {
+        if(SINK_DROP_NEWEST == policy)
+        {
+            sinkCount(q, SINK_DROPPED_NEWEST);
+            pthread_mutex_unlock(&q->lock);
+            return;
+        }
+        if(SINK_BLOCK == policy && !q->closed)
+        {
+            if(!blocked) {
+                sinkCount(q, SINK_BLOCKED);
+            }
+            blocked = 1;
+            pthread_cond_wait(&q->notFull, &q->lock);
+            continue;
+        }
+        q->head = (q->head + 1) % __sinkQueueMax;
+        q->count--;
+        sinkCount(q, SINK_DROPPED_OLDEST);
+    }
+
+    q->items[(q->head + q->count) % __sinkQueueMax] = r;
+    q->count++;
+    sinkCount(q, SINK_ENQUEUED);
+    if((uint64_t)q->count > q->counters[SINK_MAX_DEPTH]) {
+        __atomic_store_n(&q->counters[SINK_MAX_DEPTH], (uint64_t)q->count, __ATOMIC_RELAXED);
+    }
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Consumer side; writes queued readings until the queue is closed and empty.
+void* sinkThread(void* arg)
+{
+    sinkQueue* q = (sinkQueue*)arg;
+    for(;;)
+    {
+        profSwitch(PROF_IDLE);
+        pthread_mutex_lock(&q->lock);
+        while(0 == q->count && !q->closed) {
+            pthread_cond_wait(&q->notEmpty, &q->lock);
+        }
+        if(0 == q->count)
+        {   // Closed and drained.
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        reading r = q->items[q->head];
+        q->head = (q->head + 1) % __sinkQueueMax;
+        q->count--;
+        pthread_cond_signal(&q->notFull);
+        pthread_mutex_unlock(&q->lock);
+
+        q->write(r);
+        sinkCount(q, SINK_WRITTEN);
+    }
+    return NULL;
+}
+
+// Write out anything queued and stop the sink thread.
+void closeSink(sinkQueue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->notEmpty);
+    pthread_cond_broadcast(&q->notFull);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+}
+
+// Get the current config for a sink thread; it stays valid until releaseSinkConfig(). The config is
+// re-read after publishing the hazard pointer, so the reloader either sees the pointer or the sink sees
+// the new config.
+decoderConfig* acquireSinkConfig(sinkQueue* q)
+{
+    decoderConfig* c;
+    do
+    {
+        c = __atomic_load_n(&_publishedConfig, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&q->cfgInUse, c, __ATOMIC_SEQ_CST);
+    }
+    while(c != __atomic_load_n(&_publishedConfig, __ATOMIC_SEQ_CST));
+    return c;
+}
+
+void releaseSinkConfig(sinkQueue* q)
+{
+    __atomic_store_n(&q->cfgInUse, (decoderConfig*)NULL, __ATOMIC_RELEASE);
+}
+
+int sinksUsingConfig(const decoderConfig* c)
+{
+    for(int i=0; i<_sinkCount; i++)
+    {
+        if(c == __atomic_load_n(&_sinks[i]->cfgInUse, __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void printSinkStats(FILE* f)
+{
+    for(int i=0; i<_sinkCount; i++)
+    {
+        fprintf(f, "piook sink %s:", _sinks[i]->name);
+        for(int j=0; j<SINK_COUNTER_COUNT; j++) {
+            fprintf(f, " %s=%llu", __sinkCounterNames[j], (unsigned long long)__atomic_load_n(&_sinks[i]->counters[j], __ATOMIC_RELAXED));
+        }
+        fprintf(f, "\n");
+    }
+    fflush(f);
+}
+
+// Write function of the output sink (the output file, or stdout).
+void writeOutputReading(const reading& r)
+{
+    decoderConfig* c = acquireSinkConfig(&_outputSink);
+    HOT_PATH_ENTER();
+    publishReading(c, r, &r.quality);
+    HOT_PATH_EXIT();
+    releaseSinkConfig(&_outputSink);
+    ALLOC_CHECK_WARMED_UP();
+
+    uint64_t publishedNs = monotonicNs();
+    histRecord(HIST_VALIDATED_TO_SINK, publishedNs - r.validatedNs);
+    PIOOK_PROBE3(reading_published, publishedNs, r.tempInt, r.rh);
+}
+
+/*===========================================================
+Rolling statistics (stats_windows).
+Min, max, mean and rate of change of each sensor's temperature and RH over up to __maxStatWindows
+trailing windows (e.g. 10 minutes, 1 hour and 24 hours), updated as each reading is decoded and
+published with it, so that consumers need not reread the history. Each sensor keeps its last
+__rollingSamples readings in a ring shared by all of its windows. A window is the run of readings
+newer than its duration, with running sums for the mean and monotonic deques for the extremes: the
+ring positions of the readings that could still become the window's min (or max), i.e. each newer
+than and lower than the one before it. A reading is pushed onto and expired from each deque at most
+once, so an update is amortised O(1) for any window length, and the memory is fixed. Windows longer
+than the ring (about 34 hours at a reading a minute) cover the readings kept. The state is only
+touched on the decoder thread; the summary travels to the sink in the queued reading.
+=============================================================*/
+sensorHistory _sensorHistory[__maxSensors];
+
+// Parse a duration such as "90", "90s", "15m", "1h" or "7d" (seconds by default). Returns -1 if there is no number.
+int parseDuration(const char* s, char** end, unsigned long* sec)
+{
+    unsigned long v = strtoul(s, end, 10);
+    if(*end == s || '-' == *s) {
+        return -1;
+    }
+    switch(**end)
+    {
+        case 'd': v *= 24;      // Fall through.
+        case 'h': v *= 60;      // Fall through.
+        case 'm': v *= 60;      // Fall through.
+        case 's': (*end)++; break;
+        default: break;
+    }
+    *sec = v;
+    return 0;
+}
+
+// Parse a comma separated list of window durations, e.g. "10m,1h,24h".
+int parseStatWindows(const char* value, decoderConfig* c)
+{
+    int count = 0;
+    unsigned int sec[__maxStatWindows];
+    const char* p = value;
+    while(*p)
+    {
+        char* end;
+        unsigned long v;
+        if(count == __maxStatWindows || 0 != parseDuration(p, &end, &v)) {
+            return -1;
+        }
+        if(0 == v || v > __maxStatWindowSec || (',' != *end && 0 != *end)) {
+            return -1;
+        }
+        sec[count++] = (unsigned int)v;
+        p = ',' == *end ? end + 1 : end;
+    }
+    c->statWindowCount = count;
+    memcpy(c->statWindowSec, sec, sizeof(sec));
+    return 0;
+}
+
+static inline int dequeBack(const monoDeque* d)
+{
+    return d->pos[(d->head + d->count - 1) % __rollingSamples];
+}
+
+// Push a reading's ring position onto a min (sign 1) or max (sign -1) deque, first dropping the readings
+// it supersedes; an older reading can never again be the window's min once a lower or equal one arrives.
+static void dequePush(monoDeque* d, const int16_t* values, int pos, int sign)
+{
+    int v = values[pos] * sign;
+    while(d->count > 0 && values[dequeBack(d)] * sign >= v) {
+        d->count--;
+    }
+    d->pos[(d->head + d->count) % __rollingSamples] = (uint16_t)pos;
+    d->count++;
+}
+
+// Expire a reading's ring position from the front of a deque, if it is still there.
+static void dequeExpire(monoDeque* d, int pos)
+{
+    if(d->count > 0 && d->pos[d->head] == pos)
+    {
+        d->head = (d->head + 1) % __rollingSamples;
+        d->count--;
+    }
+}
+
+// Drop the oldest reading from a window.
+static void windowExpire(sensorHistory* h, rollingWindow* w)
+{
+    int pos = w->first % __rollingSamples;
+    w->tempSum -= h->temp[pos];
+    w->rhSum -= h->rh[pos];
+    dequeExpire(&w->tempMin, pos);
+    dequeExpire(&w->tempMax, pos);
+    dequeExpire(&w->rhMin, pos);
+    dequeExpire(&w->rhMax, pos);
+    w->first++;
+}
+
+// Add the reading with sequence number seq (the newest) to each window, and expire the readings that are
+// now older than the window.
+static void windowsAdvance(sensorHistory* h, uint32_t seq)
+{
+    int pos = seq % __rollingSamples;
+    for(int i=0; i<h->windowCount; i++)
+    {
+        rollingWindow* w = &h->windows[i];
+        w->tempSum += h->temp[pos];
+        w->rhSum += h->rh[pos];
+        dequePush(&w->tempMin, h->temp, pos, 1);
+        dequePush(&w->tempMax, h->temp, pos, -1);
+        dequePush(&w->rhMin, h->rh, pos, 1);
+        dequePush(&w->rhMax, h->rh, pos, -1);
+
+        uint64_t windowNs = (uint64_t)h->windowSec[i] * 1000000000ULL;
+        while(w->first < seq && h->timeNs[pos] - h->timeNs[w->first % __rollingSamples] > windowNs) {
+            windowExpire(h, w);
+        }
+    }
+}
+
+// Adopt new window durations, rebuilding the windows from the readings kept.
+static void resetWindows(sensorHistory* h, const decoderConfig* c)
+{
+    uint32_t oldest = h->next > (uint32_t)__rollingSamples ? h->next - __rollingSamples : 0;
+    h->windowCount = c->statWindowCount;
+    memcpy(h->windowSec, c->statWindowSec, sizeof(h->windowSec));
+    for(int i=0; i<__maxStatWindows; i++)
+    {
+        rollingWindow* w = &h->windows[i];
+        w->first = oldest;
+        w->tempSum = 0;
+        w->rhSum = 0;
+        w->tempMin.head = w->tempMin.count = 0;
+        w->tempMax.head = w->tempMax.count = 0;
+        w->rhMin.head = w->rhMin.count = 0;
+        w->rhMax.head = w->rhMax.count = 0;
+    }
+    for(uint32_t seq = oldest; seq < h->next; seq++) {
+        windowsAdvance(h, seq);
+    }
+}
+
+static inline int roundDiv(int64_t n, int64_t d)
+{
+    return (int)(n >= 0 ? (n + d / 2) / d : -((-n + d / 2) / d));
+}
+
+// Summarise one of a sensor's values (temp or RH) over a window; scale converts to tenths. The rate is
+// left at 0 until the window spans at least a second.
+static void summariseValue(const sensorHistory* h, const rollingWindow* w, const int16_t* values, const monoDeque* dmin,
+    const monoDeque* dmax, int64_t sum, int scale, rollingValue* out)
+{
+    uint32_t last = h->next - 1;
+    int firstPos = w->first % __rollingSamples;
+    int lastPos = last % __rollingSamples;
+    out->min = values[dmin->pos[dmin->head]] * scale;
+    out->max = values[dmax->pos[dmax->head]] * scale;
+    out->mean = roundDiv(sum * scale, last - w->first + 1);
+    uint64_t spanNs = h->timeNs[lastPos] - h->timeNs[firstPos];
+    out->ratePerHour = spanNs < 1000000000ULL ? 0 : roundDiv((int64_t)(values[lastPos] - values[firstPos]) * scale * 3600000000000LL, spanNs);
+}
+
+// Record a sensor's reading and summarise its rolling statistics into out. Decoder thread only.
+void updateRollingStats(int sensor, const decoderConfig* c, const reading& r, rollingSummary* out)
+{
+    sensorHistory* h = &_sensorHistory[sensor];
+    if(h->windowCount != c->statWindowCount || 0 != memcmp(h->windowSec, c->statWindowSec, sizeof(h->windowSec))) {
+        resetWindows(h, c);
+    }
+
+    // Expire the reading about to be overwritten from any window still holding it.
+    uint32_t seq = h->next;
+    if(seq >= (uint32_t)__rollingSamples)
+    {
+        for(int i=0; i<h->windowCount; i++)
+        {
+            if(h->windows[i].first == seq - __rollingSamples) {
+                windowExpire(h, &h->windows[i]);
+            }
+        }
+    }
+
+    int pos = seq % __rollingSamples;
+    h->timeNs[pos] = r.frameEndNs;
+    h->temp[pos] = (int16_t)r.tempInt;
+    h->rh[pos] = (int16_t)r.rh;
+    h->next = seq + 1;
+    windowsAdvance(h, seq);
+
+    out->windowCount = h->windowCount;
+    for(int i=0; i<h->windowCount; i++)
+    {
+        const rollingWindow* w = &h->windows[i];
+        rollingWindowStats* ws = &out->windows[i];
+        ws->windowSec = h->windowSec[i];
+        ws->count = h->next - w->first;
+        summariseValue(h, w, h->temp, &w->tempMin, &w->tempMax, w->tempSum, 1, &ws->temp);
+        summariseValue(h, w, h->rh, &w->rhMin, &w->rhMax, w->rhSum, 10, &ws->rh);
+    }
+}
+
+/*===========================================================
+Alert rules (rule = ... in the config file).
+Threshold, hysteresis, rate of change and staleness conditions per sensor, e.g.
+    rule = frost 82 temp < 0 for 15m        (outside temp below 0 C for 15 minutes)
+    rule = damp * rh > 70 clear 65          (raise above 70%, clear only once back at 65% or below)
+    rule = warming * temp_rate_1h > 3       (rising faster than 3 C an hour; needs stats_windows 1h)
+    rule = silent * stale 5m                (no reading for 5 minutes)
+Each rule is compiled once, when the config is built, into a single predicate (see alertRule); the
+config also holds a bitmask of the rules per sensor ID, so a reading only evaluates the rules that
+touch its sensor. Reading rules run on the decoder thread as each reading is decoded; stale rules
+run on the event loop tick. Each keeps its own state per rule and sensor (whether the condition
+holds, since when, and whether the alert is raised), which is reset when a reload changes the rules.
+Raised and cleared alerts are queued for the alert sink, which appends them to outfile.alerts (and
+reports them on stderr).
+=============================================================*/
+const char* __ruleFieldNames[] = { "temp", "rh", "temp_mean_", "rh_mean_", "temp_rate_", "rh_rate_", "stale" };
+
+struct ruleState {
+    int holding;                // The condition holds (since sinceNs).
+    int active;                 // The alert is raised.
+    uint64_t sinceNs;
+};
+
+ruleState _readingRuleState[__maxRules][__maxSensors];  // Decoder thread only.
+ruleState _staleRuleState[__maxRules][__maxSensors];    // Event loop thread only.
+sinkQueue _alertSink;
+
+// Parse a value in tenths, e.g. "-0.5" as -5.
+static int parseTenthsValue(const char* s, int* tenths)
+{
+    char* end;
+    double v = strtod(s, &end);
+    if(end == s || 0 != *end || v < -100000 || v > 100000) {
+        return -1;
+    }
+    *tenths = (int)(v * 10 + (v < 0 ? -0.5 : 0.5));
+    return 0;
+}
+
+// Compile a rule ("name sensor|* field op value [clear value] [for duration]" or "name sensor|* stale duration").
+int parseRule(const char* value, decoderConfig* c)
+{
+    char name[32], sensor[16], field[32], op[4], limit[32], word[2][8], arg[2][32];
+    int n = sscanf(value, "%31s %15s %31s %3s %31s %7s %31s %7s %31s", name, sensor, field, op, limit,
+        word[0], arg[0], word[1], arg[1]);
+    if(n < 4 || c->ruleCount == __maxRules) {
+        return -1;
+    }
+
+    alertRule rule;
+    memset(&rule, 0, sizeof(rule));
+    snprintf(rule.name, sizeof(rule.name), "%s", name);
+    char* end = sensor;
+    rule.sensorId = 0 == strcmp(sensor, "*") ? -1 : (int)strtol(sensor, &end, 10);
+    if(-1 != rule.sensorId && (end == sensor || 0 != *end || rule.sensorId < 0 || rule.sensorId >= __sensorIdCount)) {
+        return -1;
+    }
+
+    if(0 == strcmp(field, "stale"))
+    {
+        unsigned long sec;
+        if(4 != n || 0 != parseDuration(op, &end, &sec) || 0 != *end || 0 == sec) {
+            return -1;
+        }
+        rule.field = RULE_STALE;
+        rule.holdNs = sec * 1000000000ULL;
+    }
+    else
+    {
+        // The value: temp, rh, or a rolling statistic of either with its window, e.g. temp_rate_1h.
+        rule.field = -1;
+        for(int i=RULE_TEMP; i<RULE_STALE; i++)
+        {
+            const char* fieldName = __ruleFieldNames[i];
+            size_t len = strlen(fieldName);
+            if(i < RULE_TEMP_MEAN && 0 == strcmp(field, fieldName)) {
+                rule.field = i;
+            }
+            else if(i >= RULE_TEMP_MEAN && 0 == strncmp(field, fieldName, len))
+            {
+                unsigned long sec;
+                if(0 != parseDuration(field + len, &end, &sec) || 0 != *end || 0 == sec) {
+                    return -1;
+                }
+                rule.field = i;
+                rule.windowSec = (unsigned int)sec;
+            }
+        }
+
+        int orEqual = '=' == op[1] && 0 == op[2];
+        if(-1 == rule.field || n < 5 || 0 != (n - 5) % 2 || (0 != op[1] && !orEqual) || ('<' != op[0] && '>' != op[0])) {
+            return -1;
+        }
+        // Values are integer tenths, so <= t is < t+1 (and >= t is > t-1).
+        int threshold;
+        if(0 != parseTenthsValue(limit, &threshold)) {
+            return -1;
+        }
+        rule.sign = '<' == op[0] ? 1 : -1;
+        rule.raiseLimit = threshold * rule.sign + orEqual;
+        rule.clearLimit = rule.raiseLimit;
+
+        // Options.
+        for(int i=0; i < (n - 5) / 2; i++)
+        {
+            unsigned long sec;
+            int clearAt;
+            if(0 == strcmp(word[i], "clear") && 0 == parseTenthsValue(arg[i], &clearAt) && clearAt * rule.sign >= rule.raiseLimit) {
+                rule.clearLimit = clearAt * rule.sign;
+            }
+            else if(0 == strcmp(word[i], "for") && 0 == parseDuration(arg[i], &end, &sec) && 0 == *end) {
+                rule.holdNs = sec * 1000000000ULL;
+            }
+            else {
+                return -1;
+            }
+        }
+    }
+
+    // Index the rule.
+    int bit = 1 << c->ruleCount;
+    if(RULE_STALE == rule.field) {
+        c->staleRules |= bit;
+    }
+    else
+    {
+        for(int id=0; id<__sensorIdCount; id++)
+        {
+            if(-1 == rule.sensorId || id == rule.sensorId) {
+                c->sensorRules[id] |= bit;
+            }
+        }
+    }
+    c->rules[c->ruleCount++] = rule;
+    return 0;
+}
+
+// Description of the problem with the config's rules, or NULL if they are valid.
+const char* rulesError(const decoderConfig* c)
+{
+    for(int i=0; i<c->ruleCount; i++)
+    {
+        const alertRule* rule = &c->rules[i];
+        if(0 == rule->windowSec) {
+            continue;
+        }
+        int found = 0;
+        for(int j=0; j<c->statWindowCount; j++) {
+            found |= rule->windowSec == c->statWindowSec[j];
+        }
+        if(!found) {
+            return "a rule uses a rolling statistics window that is not in stats_windows";
+        }
+    }
+    return NULL;
+}
+
+int rulesChanged(const decoderConfig* a, const decoderConfig* b)
+{
+    return a->ruleCount != b->ruleCount || 0 != memcmp(a->rules, b->rules, sizeof(alertRule) * a->ruleCount);
+}
+
+void resetReadingRules()
+{
+    memset(_readingRuleState, 0, sizeof(_readingRuleState));
+}
+
+// The value of a reading tested by a rule, in tenths. Returns 0 if the reading lacks the rule's window.
+static int ruleValue(const alertRule* rule, const reading& r, int* value)
+{
+    switch(rule->field)
+    {
+        case RULE_TEMP:
+            *value = r.tempInt;
+            return 1;
+        case RULE_RH:
+            *value = r.rh * 10;
+            return 1;
+        default:
+            break;
+    }
+    for(int i=0; i<r.rolling.windowCount; i++)
+    {
+        const rollingWindowStats* w = &r.rolling.windows[i];
+        if(w->windowSec != rule->windowSec) {
+            continue;
+        }
+        switch(rule->field)
+        {
+            case RULE_TEMP_MEAN: *value = w->temp.mean; break;
+            case RULE_RH_MEAN: *value = w->rh.mean; break;
+            case RULE_TEMP_RATE: *value = w->temp.ratePerHour; break;
+            default: *value = w->rh.ratePerHour; break;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Queue a raised or cleared alert, with the reading concerned, for the alert sink. nowNs is the time
+// it was raised or cleared (a capture time, so a replayed alert has the recording's time).
+static void queueAlert(const decoderConfig* c, const alertRule* rule, int raised, uint64_t nowNs, const reading& r)
+{
+    reading a = r;
+    a.alert = raised;
+    a.unixNs = captureUnixNs(nowNs);
+    memcpy(a.alertName, rule->name, sizeof(a.alertName));
+    sinkEnqueue(&_alertSink, a, c->alertSinkPolicy, c->alertSinkQueueLen);
+}
+
+// Advance one rule's state for a sensor, given whether its condition holds and, once raised, whether
+// the value is past the clear limit. The alert is raised once the condition has held for holdNs.
+static void stepRule(const decoderConfig* c, const alertRule* rule, ruleState* s, int holds, int cleared, uint64_t nowNs, uint64_t holdNs, const reading& r)
+{
+    if(s->active)
+    {
+        if(cleared)
+        {
+            s->active = 0;
+            s->holding = 0;
+            queueAlert(c, rule, 0, nowNs, r);
+        }
+        return;
+    }
+    if(!holds)
+    {
+        s->holding = 0;
+        return;
+    }
+    if(!s->holding)
+    {
+        s->holding = 1;
+        s->sinceNs = nowNs;
+    }
+    if(nowNs - s->sinceNs >= holdNs)
+    {
+        s->active = 1;
+        queueAlert(c, rule, 1, nowNs, r);
+    }
+}
+
+// Evaluate the rules touching a reading's sensor. Decoder thread only.
+void evaluateRules(const decoderConfig* c, int sensor, const reading& r)
+{
+    for(unsigned int mask = c->sensorRules[r.sensorId & (__sensorIdCount - 1)]; 0 != mask; mask &= mask - 1)
+    {
+        int i = __builtin_ctz(mask);
+        const alertRule* rule = &c->rules[i];
+        int v;
+        if(ruleValue(rule, r, &v))
+        {
+            v *= rule->sign;
+            stepRule(c, rule, &_readingRuleState[i][sensor], v < rule->raiseLimit, v >= rule->clearLimit, r.frameEndNs, rule->holdNs, r);
+        }
+    }
+}
+
+// Evaluate the stale rules for every known sensor. Event loop thread only.
+void staleRulesTick(const decoderConfig* c, uint64_t nowNs)
+{
+    static decoderConfig lastRules;     // A copy; the config it came from may since have been freed.
+    if(rulesChanged(&lastRules, c))
+    {
+        memset(_staleRuleState, 0, sizeof(_staleRuleState));
+        lastRules.ruleCount = c->ruleCount;
+        memcpy(lastRules.rules, c->rules, sizeof(lastRules.rules));
+    }
+
+    int sensorCount = __atomic_load_n(&_sensorCount, __ATOMIC_ACQUIRE);
+    for(unsigned int mask = c->staleRules; 0 != mask; mask &= mask - 1)
+    {
+        int i = __builtin_ctz(mask);
+        const alertRule* rule = &c->rules[i];
+        for(int j=0; j<sensorCount; j++)
+        {
+            if(-1 != rule->sensorId && rule->sensorId != _sensors[j].id) {
+                continue;
+            }
+            reading r;
+            memset(&r, 0, sizeof(r));
+            r.protocol = PIOOK_PROTOCOL_CM7;
+            r.sensorId = _sensors[j].id;
+            r.tempInt = __atomic_load_n(&_sensors[j].tempInt, __ATOMIC_RELAXED);
+            r.rh = __atomic_load_n(&_sensors[j].rh, __ATOMIC_RELAXED);
+            r.frameEndNs = __atomic_load_n(&_sensors[j].lastHeardNs, __ATOMIC_RELAXED);
+            int silent = nowNs - r.frameEndNs > rule->holdNs;
+            stepRule(c, rule, &_staleRuleState[i][j], silent, !silent, nowNs, 0, r);
+        }
+    }
+}
+
+// Write function of the alert sink; appends e.g. "1792274833 raised frost sensor=82 temp=-0.5 rh=80" to
+// outfile.alerts, and reports it on stderr.
+void writeAlert(const reading& r)
+{
+    char line[__maxAlertLen];
+    int len = formatAlert(line, (uint64_t)(r.unixNs / 1000000000LL), r.alert, r.alertName, r.sensorId, r.tempInt, r.rh);
+    fprintf(stderr, "piook: alert %.*s", len, line);
+
+    decoderConfig* c = acquireSinkConfig(&_alertSink);
+    if(0 != c->outfilename[0])
+    {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s.alerts", c->outfilename);
+        if(0 != appendFile(path, line, len)) {
+            fprintf(stderr, "piook: failed to write %s.\n", path);
+        }
+    }
+    releaseSinkConfig(&_alertSink);
+}
+
+/*===========================================================
+Aggregation sink (aggregate_interval, aggregate_deadband).
+For consumers on constrained links or storage: instead of every reading, append one record per
+sensor per interval with the mean, min, max and rate of change of its readings over the interval
+(and the last reading as the record's own temp and RH), and/or a record as soon as a reading moves
+beyond a deadband from the last one sent. Records go to outfile.aggregate in the output format,
+with the aggregate as a rolling statistics window (e.g. "w300s"), while the output file carries on
+as before. The state is O(1) per sensor: counts, sums, extremes, and the first and last reading of
+the interval. Intervals are wall clock periods (e.g. on the five minutes) of the readings' capture
+times, so a replayed recording aggregates by its own times. Readings are added on the decoder
+thread, and a reading in a later interval sends its sensor's aggregate of the previous one; the
+event loop's tick sends the aggregates of intervals that have ended without a further reading
+(live only; a replay would end them early). A short lock guards the state between the two;
+records are queued for the sink's thread.
+=============================================================*/
+struct aggregateState {
+    int count;
+    int64_t tempSum, rhSum;
+    int tempMin, tempMax, rhMin, rhMax;
+    int firstTemp, firstRh;
+    uint64_t firstNs;
+    int lastTemp, lastRh;
+    uint64_t lastNs;
+    uint64_t interval;          // Index of the interval (Unix time / interval) of the readings.
+    int sentTemp, sentRh;       // Last values sent, for the deadband.
+    int haveSent;
+};
+
+aggregateState _aggregates[__maxSensors];
+pthread_mutex_t _aggregateLock = PTHREAD_MUTEX_INITIALIZER;
+sinkQueue _aggregateSink;
+
+// Queue a sensor's aggregate and start a new one. Called with the lock held.
+static void sendAggregate(const decoderConfig* c, int sensor, unsigned int intervalSec)
+{
+    aggregateState* a = &_aggregates[sensor];
+    reading r;
+    memset(&r, 0, sizeof(r));
+    r.protocol = PIOOK_PROTOCOL_CM7;
+    r.sensorId = _sensors[sensor].id;
+    r.tempInt = a->lastTemp;
+    r.rh = a->lastRh;
+    r.frameEndNs = a->lastNs;
+    r.unixNs = captureUnixNs(a->lastNs);
+    r.alert = -1;
+    r.rolling.windowCount = 1;
+
+    // As a rolling statistics window, in tenths; the window is the interval, or for a deadband record
+    // the time since the interval began.
+    rollingWindowStats* w = &r.rolling.windows[0];
+    w->windowSec = 0 != intervalSec ? intervalSec : (unsigned int)((a->lastNs - a->firstNs) / 1000000000ULL);
+    w->count = a->count;
+    w->temp.min = a->tempMin;
+    w->temp.max = a->tempMax;
+    w->temp.mean = (int)((a->tempSum * 2 + (a->tempSum < 0 ? -a->count : a->count)) / (2 * a->count));
+    w->rh.min = a->rhMin * 10;
+    w->rh.max = a->rhMax * 10;
+    w->rh.mean = (int)((a->rhSum * 20 + a->count) / (2 * a->count));
+    uint64_t spanNs = a->lastNs - a->firstNs;
+    if(spanNs >= 1000000000ULL)
+    {
+        w->temp.ratePerHour = (int)((int64_t)(a->lastTemp - a->firstTemp) * 3600000000000LL / (int64_t)spanNs);
+        w->rh.ratePerHour = (int)((int64_t)(a->lastRh - a->firstRh) * 36000000000000LL / (int64_t)spanNs);
+    }
+    sinkEnqueue(&_aggregateSink, r, c->aggregateSinkPolicy, c->aggregateSinkQueueLen);
+
+    a->sentTemp = a->lastTemp;
+    a->sentRh = a->lastRh;
+    a->haveSent = 1;
+    a->count = 0;
+}
+
+// Add a reading to its sensor's aggregate. Decoder thread.
+void aggregateReading(const decoderConfig* c, int sensor, const reading& r)
+{
+    unsigned int intervalSec = c->aggregateIntervalSec;
+    uint64_t interval = 0 != intervalSec ? (uint64_t)(captureUnixNs(r.frameEndNs) / 1000000000LL) / intervalSec : 0;
+
+    pthread_mutex_lock(&_aggregateLock);
+    aggregateState* a = &_aggregates[sensor];
+    if(0 != a->count && interval != a->interval) {
+        sendAggregate(c, sensor, intervalSec);
+    }
+    if(0 == a->count)
+    {
+        a->tempSum = a->rhSum = 0;
+        a->tempMin = a->tempMax = a->firstTemp = r.tempInt;
+        a->rhMin = a->rhMax = a->firstRh = r.rh;
+        a->firstNs = r.frameEndNs;
+        a->interval = interval;
+    }
+    a->count++;
+    a->tempSum += r.tempInt;
+    a->rhSum += r.rh;
+    a->tempMin = r.tempInt < a->tempMin ? r.tempInt : a->tempMin;
+    a->tempMax = r.tempInt > a->tempMax ? r.tempInt : a->tempMax;
+    a->rhMin = r.rh < a->rhMin ? r.rh : a->rhMin;
+    a->rhMax = r.rh > a->rhMax ? r.rh : a->rhMax;
+    a->lastTemp = r.tempInt;
+    a->lastRh = r.rh;
+    a->lastNs = r.frameEndNs;
+
+    // Deadband (tenths of a degree, and of a % RH); the first reading of a sensor is always sent.
+    int deadband = c->aggregateDeadband;
+    if(0 != deadband && (!a->haveSent || abs(r.tempInt - a->sentTemp) > deadband || abs(r.rh * 10 - a->sentRh * 10) > deadband)) {
+        sendAggregate(c, sensor, 0);
+    }
+    pthread_mutex_unlock(&_aggregateLock);
+}
+
+// Send the aggregates (of sensors with readings) of intervals that have ended, or all of them when flushing at shutdown.
+void aggregateTick(const decoderConfig* c, int flush)
+{
+    unsigned int intervalSec = c->aggregateIntervalSec;
+    if(!flush && (0 == intervalSec || NULL != _replayFilename)) {
+        return;
+    }
+    uint64_t interval = 0 != intervalSec ? (uint64_t)time(NULL) / intervalSec : 0;
+
+    pthread_mutex_lock(&_aggregateLock);
+    int sensorCount = __atomic_load_n(&_sensorCount, __ATOMIC_ACQUIRE);
+    for(int i=0; i<sensorCount; i++)
+    {
+        if(_aggregates[i].count > 0 && (flush || _aggregates[i].interval < interval)) {
+            sendAggregate(c, i, intervalSec);
+        }
+    }
+    pthread_mutex_unlock(&_aggregateLock);
+}
+
+// Write function of the aggregation sink; appends the record to outfile.aggregate (or writes it to stdout).
+void writeAggregate(const reading& r)
+{
+    decoderConfig* c = acquireSinkConfig(&_aggregateSink);
+    int format = c->outputFormat;
+    if(FORMAT_AUTO == format) {
+        format = 0 != c->outfilename[0] ? FORMAT_CSV : FORMAT_TEXT;
+    }
+
+    int64_t unixNs = r.unixNs;    // The time of the aggregate's last reading.
+    char record[__maxRecordLen] __attribute__((aligned(8)));
+    int recordLen;
+    if(FORMAT_BINARY == format)
+    {   // The binary record has no room for the aggregate; it carries the last reading.
+        encodeRecord((piook_record*)record, r, NULL, 0, unixNs);
+        recordLen = sizeof(piook_record);
+    }
+    else {
+        recordLen = formatRecord(record, format, r.sensorId, r.tempInt, r.rh, NULL, &r.rolling, unixNs);
+    }
+
+    if(0 != c->outfilename[0])
+    {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s.aggregate", c->outfilename);
+        if(0 != appendFile(path, record, recordLen)) {
+            fprintf(stderr, "piook: failed to write %s.\n", path);
+        }
+    }
+    else {
+        fwrite(record, 1, recordLen, stdout);
+    }
+    releaseSinkConfig(&_aggregateSink);
+}
+
+/*===========================================================
+Adaptive jitter window (adaptive_jitter).
+The timing windows must allow for the latency between an edge and its timestamp, which on a
+non-realtime kernel varies with load; a fixed jitter window is either too wide on a quiet
+system (more noise gets framed as pulses) or too narrow on a loaded one (frames are lost).
+The wiringPi ISR gives no kernel timestamp to compare against, so the latency is sampled
+instead: a probe thread at the ISR thread's priority sleeps to a deadline every
+__jitterProbeIntervalNs and records how late it wakes (HIST_WAKE_LATENCY). A pulse duration
+is the difference of two such latencies, so its error is bounded by the latency itself.
+
+Every __jitterAdaptSec the event loop takes the period's p99.9 latency, adds an allowance for
+the transmitter's own timing error, and never goes below the largest pulse deviation of a frame
+decoded in the period (plus half the allowance). The window widens to the result at once and
+narrows halfway towards it each period, within jitter_min_us and jitter_max_us, and is published
+as a new config (as for a reload). The adapted window is kept over reloads, and is saved in the
+--state snapshot, so a restart resumes from it.
+=============================================================*/
+const long __jitterProbeIntervalNs = 10000000L;
+const int __isrPriority = 55;                   // wiringPi's ISR thread priority (see piHiPri()).
+const int __jitterAdaptSec = 60;
+const uint64_t __jitterMinSamples = 1000;       // Fewer in a period means the probe itself is being starved.
+const unsigned int __jitterAllowanceMu = 100;   // Transmitter timing error and receiver edge skew.
+const unsigned int __jitterStepMu = 10;
+
+unsigned int _adaptedJitterMu = 0;              // Latest adapted window (0 for none yet); event loop thread.
+int _frameMaxDevMu = 0;                         // Largest pulse deviation of a frame in the current period.
+
+void* jitterProbeThread(void*)
+{
+    piHiPri(__isrPriority);
+
+    struct timespec due;
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    for(;;)
+    {
+        due.tv_nsec += __jitterProbeIntervalNs;
+        if(due.tv_nsec >= 1000000000L)
+        {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)) {}
+
+        uint64_t dueNs = (uint64_t)due.tv_sec * 1000000000ULL + due.tv_nsec;
+        uint64_t nowNs = monotonicNs();
+        histRecord(HIST_WAKE_LATENCY, nowNs - dueNs);
+        if(nowNs - dueNs > (uint64_t)__jitterProbeIntervalNs) {
+            clock_gettime(CLOCK_MONOTONIC, &due);   // Suspended or stalled; don't fire a burst to catch up.
+        }
+    }
+    return NULL;
+}
+
+// Decoder thread; note a decoded frame's largest pulse deviation. A reset by the event loop may be
+// overwritten by a frame from the period just ended, which only errs on the wide side.
+void noteFrameDeviation(int maxDevMu)
+{
+    if(maxDevMu > __atomic_load_n(&_frameMaxDevMu, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&_frameMaxDevMu, maxDevMu, __ATOMIC_RELAXED);
+    }
+}
+
+// Called on each event loop tick.
+void jitterTick(const decoderConfig* c)
+{
+    // Static because a snapshot is ~8KB.
+    static latencyHist last;
+    static latencyHist period;
+    static pthread_t probeThreadId;
+    static int probeStarted = 0;
+    static int ticks = 0;
+
+    if(!c->adaptiveJitter) {
+        return;
+    }
+    if(!probeStarted)
+    {
+        if(0 != pthread_create(&probeThreadId, NULL, &jitterProbeThread, NULL)) {
+            return;
+        }
+        probeStarted = 1;
+        histSnapshot(HIST_WAKE_LATENCY, &last);
+        return;
+    }
+    if(++ticks < __jitterAdaptSec || NULL != _retiredConfig) {
+        return;     // Not yet, or a reload is still being reclaimed; try again next tick.
+    }
+    ticks = 0;
+
+    // The period's latencies are the difference of two snapshots.
+    histSnapshot(HIST_WAKE_LATENCY, &period);
+    uint64_t total = 0;
+    for(int i=0; i<__histBucketCount; i++)
+    {
+        uint64_t count = period.counts[i] - last.counts[i];
+        last.counts[i] = period.counts[i];
+        period.counts[i] = count;
+        total += count;
+        if(0 != count) {
+            period.max = histBucketUpperValue(i);
+        }
+    }
+    int maxDevMu = __atomic_exchange_n(&_frameMaxDevMu, 0, __ATOMIC_RELAXED);
+    if(total < __jitterMinSamples) {
+        return;
+    }
+
+    unsigned int latencyMu = (unsigned int)((histPercentile(&period, total, 99.9) + 999) / 1000);
+    unsigned int target = latencyMu + __jitterAllowanceMu;
+    if(maxDevMu + __jitterAllowanceMu / 2 > target) {
+        target = maxDevMu + __jitterAllowanceMu / 2;
+    }
+    target = (target + __jitterStepMu - 1) / __jitterStepMu * __jitterStepMu;
+    if(target < c->jitterMinMu) {
+        target = c->jitterMinMu;
+    }
+    if(target > c->jitterMaxMu) {
+        target = c->jitterMaxMu;
+    }
+
+    // Widen at once, narrow gradually (one quiet period after a loaded one is not enough to go by).
+    unsigned int jitter = target;
+    if(target < c->jitterWindow) {
+        jitter = target + (c->jitterWindow - target) / 2 / __jitterStepMu * __jitterStepMu;
+    }
+    if(jitter == c->jitterWindow) {
+        return;
+    }
+
+    decoderConfig* n = (decoderConfig*)malloc(sizeof(decoderConfig));
+    if(NULL == n) {
+        return;
+    }
+    *n = *c;
+    n->jitterWindow = jitter;
+    setTimingWindows(n);
+    if(NULL != configError(n))
+    {   // Not expected; the limits were validated with the config.
+        free(n);
+        return;
+    }
+
+    _adaptedJitterMu = jitter;
+    publishConfig(n);
+    fprintf(stderr, "piook: jitter window now %uus (wake latency p99.9 %uus, frame max deviation %dus).\n", jitter, latencyMu, maxDevMu);
+}
+
+/*===========================================================
+Health watchdog.
+Once a second (on the event loop tick) the watchdog checks for:
+ - A sensor that has not been heard for __sensorSilentIntervals transmission intervals.
+ - No edges at all for __deadPinSec; the receiver module always outputs noise between
+   transmissions, so this means a dead receiver or broken wiring. Mitigation: reinitialise
+   the pin and its edge interrupt.
+ - An edge rate above __stormEdgesPerSec (an interrupt storm). Mitigation escalates every
+   __stormEscalateSec while the storm persists: first the glitch filter is raised, then capture
+   switches from interrupts to polling. Each step is backed out after __stormCalmSec of calm.
+Health flags are reported on stderr and in the status file (outfile.status) when they change.
+=============================================================*/
+const int __sensorSilentIntervals = 5;
+const int __deadPinSec = 30;
+const uint64_t __stormEdgesPerSec = 20000;
+const unsigned int __stormGlitchFilterMu = 150;  // Must stay below the shortest pulse window (offShortMuLower).
+const int __stormEscalateSec = 5;
+const int __stormCalmSec = 60;
+
+const char* __healthFlagNames[] = { "sensor_silent", "pin_dead", "storm" };
+const char* __mitigationNames[] = { "none", "glitch_filter", "polling" };
+
+sensorState _sensors[__maxSensors];
+int _sensorCount = 0;
+int _healthFlags = 0;
+int _stormMitigation = 0;
+int _maxStormMitigation = 2;    // 1 once switching to polling has failed (the pin's interrupt cannot be disabled).
+
+// Note that a sensor has been heard, and its reading. Called on the decoder thread only.
+// Returns the sensor's index in _sensors, or -1 if the table is full.
+int noteSensorHeard(int id, int tempInt, int rh, uint64_t nowNs)
+{
+    for(int i=0; i<_sensorCount; i++)
+    {
+        if(_sensors[i].id == id)
+        {
+            __atomic_store_n(&_sensors[i].tempInt, tempInt, __ATOMIC_RELAXED);
+            __atomic_store_n(&_sensors[i].rh, rh, __ATOMIC_RELAXED);
+            __atomic_store_n(&_sensors[i].lastHeardNs, nowNs, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+
+    if(_sensorCount < __maxSensors)
+    {
+        int i = _sensorCount;
+        _sensors[i].id = id;
+        _sensors[i].tempInt = tempInt;
+        _sensors[i].rh = rh;
+        _sensors[i].lastHeardNs = nowNs;
+        __atomic_store_n(&_sensorCount, _sensorCount + 1, __ATOMIC_RELEASE);
+        return i;
+    }
+    return -1;
+}
+
+// Switch the capture source. Neither source captures for a short grace period, so that the ring
+// never has two producers; the event loop completes the switch when _captureSwitchFd fires (see
+// completeCaptureSwitch()). Polling needs the pin's interrupt disabled, else the ISR thread keeps
+// taking the storm as well; returns -1 (leaving interrupt capture in place) if it cannot be.
+const long __captureSwitchGraceNs = 10000000L;
+int _captureSwitchFd = -1;
+int _pendingCaptureMode = -1;
+
+int setCaptureMode(int mode)
+{
+    static pthread_t pollThreadId;
+    static int pollThreadStarted = 0;
+
+    if(CAPTURE_POLL == mode)
+    {
+        if(0 != setPinEdge("none"))
+        {
+            fprintf(stderr, "piook: cannot disable the pin interrupt (%s); not switching to polling.\n", strerror(errno));
+            return -1;
+        }
+        if(!pollThreadStarted)
+        {
+            if(0 != pthread_create(&pollThreadId, NULL, &pollCaptureThread, NULL))
+            {
+                setPinEdge("both");
+                return -1;
+            }
+            pollThreadStarted = 1;
+        }
+    }
+
+    __atomic_store_n(&_captureMode, (int)CAPTURE_SWITCHING, __ATOMIC_RELAXED);
+    _pendingCaptureMode = mode;
+
+    struct itimerspec grace;
+    memset(&grace, 0, sizeof(grace));
+    grace.it_value.tv_nsec = __captureSwitchGraceNs;
+    timerfd_settime(_captureSwitchFd, 0, &grace, NULL);
+    return 0;
+}
+
+// Finish a switch started by setCaptureMode(), once the previous source has stopped. Event loop thread.
+void completeCaptureSwitch()
+{
+    int mode = _pendingCaptureMode;
+    _pendingCaptureMode = -1;
+    if(-1 == mode || _shutdownRequested) {
+        return;     // Capture stays stopped for shutdown.
+    }
+    if(CAPTURE_IRQ == mode && 0 != setPinEdge("both")) {
+        fprintf(stderr, "piook: cannot re-enable the pin interrupt (%s).\n", strerror(errno));
+    }
+    __atomic_store_n(&_captureMode, mode, __ATOMIC_RELAXED);
+}
+
+// Set the sysfs edge setting of the pin, which enables/disables the interrupt that wiringPi's ISR thread waits on.
+// Returns -1 (with errno set) if it cannot be written, e.g. on a kernel without the sysfs GPIO interface.
+int setPinEdge(const char* edge)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/edge", wpiPinToGpio(_pinNum));
+    FILE* f = fopen(path, "w");
+    if(NULL == f) {
+        return -1;
+    }
+    int ok = EOF != fputs(edge, f);
+    ok = 0 == fclose(f) && ok;
+    return ok ? 0 : -1;
+}
+
+void reinitCaptureLine()
+{
+    pinMode(_pinNum, INPUT);
+    if(0 != setPinEdge("none") || 0 != setPinEdge("both")) {
+        fprintf(stderr, "piook: cannot reset the pin interrupt (%s).\n", strerror(errno));
+    }
+}
+
+// The glitch filter in effect is the configured one, raised during storm mitigation.
+void applyGlitchFilter()
+{
+    unsigned int mu = _publishedConfig->glitchFilterMu;
+    if(_stormMitigation >= 1 && __stormGlitchFilterMu > mu) {
+        mu = __stormGlitchFilterMu;
+    }
+    _capture.setMinMu(mu);
+}
+
+// Give the capture side's noise folder the current timing windows (see noiseFolder).
+void applyNoiseFolding()
+{
+    _capture.next.setWindows(_publishedConfig);
+}
+
+void setStormMitigation(int level)
+{
+    int mode = level >= 2 ? CAPTURE_POLL : CAPTURE_IRQ;
+    int current = -1 != _pendingCaptureMode ? _pendingCaptureMode : __atomic_load_n(&_captureMode, __ATOMIC_RELAXED);
+    if(mode != current && 0 != setCaptureMode(mode))
+    {   // Polling on top of a storm the interrupt still takes would only add to it.
+        _maxStormMitigation = level - 1;
+        if(_maxStormMitigation == _stormMitigation) {
+            return;
+        }
+        level = _maxStormMitigation;
+    }
+    _stormMitigation = level;
+    applyGlitchFilter();
+    fprintf(stderr, "piook: storm mitigation now '%s'.\n", __mitigationNames[level]);
+}
+
+void reportHealth(int flags)
+{
+    char status[128];
+    int len = 0;
+    for(int i=0; i<HEALTH_FLAG_COUNT; i++)
+    {
+        if(flags & (1 << i)) {
+            len += snprintf(status + len, sizeof(status) - len, "%s%s", len ? "," : "", __healthFlagNames[i]);
+        }
+    }
+    if(0 == len) {
+        len = snprintf(status, sizeof(status), "ok");
+    }
+    snprintf(status + len, sizeof(status) - len, " mitigation=%s\n", __mitigationNames[_stormMitigation]);
+
+    fprintf(stderr, "piook: health %s", status);
+    if(0 != _publishedConfig->outfilename[0])
+    {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s.status", _publishedConfig->outfilename);
+        writeFileAtomic(path, status, strlen(status));
+    }
+}
+
+// Watchdog state, owned by the event loop thread.
+uint64_t _wdLastEdges = 0;
+uint64_t _wdLastNs = 0;
+uint64_t _wdLastEdgeNs = 0;
+uint64_t _wdLastReinitNs = 0;
+int _wdStormSecs = 0;
+int _wdCalmSecs = 0;
+int _wdLastReported = -1;
+
+void watchdogTick()
+{
+    uint64_t counts[STAT_COUNT];
+    uint64_t nowNs = monotonicNs();
+    statsSnapshot(counts);
+    uint64_t edges = counts[STAT_EDGES];
+
+    if(0 == _wdLastNs)
+    {   // First tick; establish the baseline.
+        _wdLastEdges = edges;
+        _wdLastNs = nowNs;
+        _wdLastEdgeNs = nowNs;
+        return;
+    }
+
+    uint64_t rate = (edges - _wdLastEdges) * 1000000000ULL / (nowNs - _wdLastNs);
+    int flags = 0;
+
+    // Stuck/dead pin.
+    if(edges != _wdLastEdges) {
+        _wdLastEdgeNs = nowNs;
+    }
+    else if(nowNs - _wdLastEdgeNs > __deadPinSec * 1000000000ULL)
+    {
+        flags |= HEALTH_PIN_DEAD;
+        if(nowNs - _wdLastReinitNs > __deadPinSec * 1000000000ULL)
+        {
+            fprintf(stderr, "piook: no edges for %ds; reinitialising pin.\n", (int)((nowNs - _wdLastEdgeNs) / 1000000000ULL));
+            reinitCaptureLine();
+            _wdLastReinitNs = nowNs;
+        }
+    }
+
+    // Interrupt storm.
+    if(rate > __stormEdgesPerSec)
+    {
+        flags |= HEALTH_STORM;
+        _wdCalmSecs = 0;
+        if(++_wdStormSecs >= __stormEscalateSec && _stormMitigation < _maxStormMitigation)
+        {
+            setStormMitigation(_stormMitigation + 1);
+            _wdStormSecs = 0;
+        }
+    }
+    else
+    {
+        _wdStormSecs = 0;
+        if(_stormMitigation > 0 && ++_wdCalmSecs >= __stormCalmSec)
+        {
+            setStormMitigation(_stormMitigation - 1);
+            _wdCalmSecs = 0;
+        }
+    }
+
+    // Silent sensors.
+    int sensorCount = __atomic_load_n(&_sensorCount, __ATOMIC_ACQUIRE);
+    for(int i=0; i<sensorCount; i++)
+    {
+        uint64_t heardNs = __atomic_load_n(&_sensors[i].lastHeardNs, __ATOMIC_RELAXED);
+        if(nowNs - heardNs > (uint64_t)__sensorSilentIntervals * __sensorIntervalSec * 1000000000ULL) {
+            flags |= HEALTH_SENSOR_SILENT;
+        }
+    }
+
+    __atomic_store_n(&_healthFlags, flags, __ATOMIC_RELAXED);
+    int reported = flags | (_stormMitigation << HEALTH_FLAG_COUNT);
+    if(reported != _wdLastReported)
+    {
+        reportHealth(flags);
+        _wdLastReported = reported;
+    }
+
+    _wdLastEdges = edges;
+    _wdLastNs = nowNs;
+}
+
+// Wall clock time (ns) of a capture time; when replaying, the recording's wall clock rather than the time of the replay.
+int64_t captureUnixNs(uint64_t captureNs)
+{
+    if(NULL != _replayFilename) {
+        return (int64_t)captureNs + _replayClockOffsetNs;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - (int64_t)(monotonicNs() - captureNs);
+}
+
+// Format a reading and write it to the output. The quality figures are optional (NULL for none).
+void publishReading(const decoderConfig* c, const reading& r, const frameQuality* quality)
+{
+    // Format the record separately from writing it, so that the two costs can be profiled separately.
+    profSwitch(PROF_FORMAT);
+    const char* outfilename = 0 != c->outfilename[0] ? c->outfilename : NULL;
+    int format = c->outputFormat;
+    if(FORMAT_AUTO == format) {
+        format = NULL != outfilename ? FORMAT_CSV : FORMAT_TEXT;
+    }
+
+    int64_t unixNs;
+    if(NULL != quality) {
+        unixNs = captureUnixNs(r.frameEndNs);
+    }
+    else
+    {   // Restored from the snapshot; published now.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        unixNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
+    char record[__maxRecordLen] __attribute__((aligned(8)));
+    int recordLen;
+    if(FORMAT_BINARY == format)
+    {   // The binary record always carries the quality figures when there are any.
+        encodeRecord((piook_record*)record, r, quality, NULL == quality ? PIOOK_RECORD_RESTORED : 0, unixNs);
+        recordLen = sizeof(piook_record);
+    }
+    else {
+        recordLen = formatRecord(record, format, r.sensorId, r.tempInt, r.rh, c->quality ? quality : NULL,
+            r.rolling.windowCount > 0 ? &r.rolling : NULL, unixNs);
+    }
+
+    // Write to file.
+    profSwitch(PROF_SINK);
+    if(NULL != outfilename) {
+        writeFileAtomic(outfilename, record, recordLen);
+    }
+    else
+    {
+        fwrite(record, 1, recordLen, stdout);
+    }
+}
+
+// Replace the contents of a file such that readers (and a crash or kill at any point) only ever see
+// the old or the new contents, never a truncated file. The new contents are synced before the rename.
+int writeFileAtomic(const char* filename, const char* buf, int len)
+{
+    // Plain syscalls rather than stdio, which would allocate a FILE and its buffer on every write.
+    char tmpName[1100];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", filename);
+
+    int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(-1 == fd) {
+        return -1;
+    }
+
+    int ok = 1;
+    for(int written = 0; ok && written < len; )
+    {
+        ssize_t n = write(fd, buf + written, len - written);
+        if(n > 0) {
+            written += n;
+        }
+        else if(-1 == n && EINTR == errno) {
+            continue;
+        }
+        else {
+            ok = 0;
+        }
+    }
+    ok &= 0 == fsync(fd);
+    ok &= 0 == close(fd);
+    if(!ok || 0 != rename(tmpName, filename))
+    {
+        unlink(tmpName);
+        return -1;
+    }
+    return 0;
+}
+
+// Append a record to a log file (alerts, aggregates), synced before returning. A single write with
+// O_APPEND, so a record is never interleaved with another.
+int appendFile(const char* filename, const char* buf, int len)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(-1 == fd) {
+        return -1;
+    }
+    int ok = len == write(fd, buf, len);
+    ok &= 0 == fsync(fd);
+    ok &= 0 == close(fd);
+    return ok ? 0 : -1;
+}
+
+void parseOptions(int argc, char *argv[])
+{
+    // Options (--name) may appear anywhere; the remaining arguments are positional.
+    char* positional[2];
+    int positionalCount = 0;
+    setDefaultConfig(&_baseConfig);
+    _baseConfig.alertSinkPolicy = SINK_DROP_NEWEST;     // Keep the transitions already queued (see alert_sink_policy).
+    _baseConfig.alertSinkQueueLen = __sinkQueueMax;
+    _baseConfig.aggregateSinkPolicy = SINK_DROP_OLDEST;
+    _baseConfig.aggregateSinkQueueLen = __sinkQueueMax;
+
+    for(int i=1; i<argc; i++)
+    {
+        if(0 == strcmp(argv[i], "--profile")) {
+            _profile = 1;
+        }
+        else if(0 == strcmp(argv[i], "--quality")) {
+            _baseConfig.quality = 1;
+        }
+        else if(0 == strcmp(argv[i], "--soft")) {
+            _baseConfig.softDecode = 1;
+        }
+        else if(0 == strcmp(argv[i], "--adaptive-jitter")) {
+            _baseConfig.adaptiveJitter = 1;
+        }
+        else if(0 == strcmp(argv[i], "--fold-noise")) {
+            _baseConfig.foldNoise = 1;
+        }
+        else if(0 == strcmp(argv[i], "--near-miss")) {
+            _baseConfig.nearMiss = 1;
+        }
+        else if(0 == strcmp(argv[i], "--config") && i+1 < argc) {
+            _configFilename = argv[++i];
+        }
+        else if(0 == strcmp(argv[i], "--state") && i+1 < argc) {
+            _stateFilename = argv[++i];
+        }
+        else if(0 == strcmp(argv[i], "--record") && i+1 < argc) {
+            _recordFilename = argv[++i];
+        }
+        else if(0 == strcmp(argv[i], "--flight-recorder") && i+1 < argc) {
+            _flightDir = argv[++i];
+        }
+        else if(0 == strcmp(argv[i], "--replay") && i+1 < argc) {
+            _replayFilename = argv[++i];
+        }
+        else if(0 == strcmp(argv[i], "--bench") && i+1 < argc) {
+            _benchFilename = argv[++i];
+        }
+        else if(0 == strcmp(argv[i], "--from") && i+1 < argc && 0 == parseReplayTime(argv[i+1], &_replayFrom)) {
+            i++;
+        }
+        else if(0 == strcmp(argv[i], "--to") && i+1 < argc && 0 == parseReplayTime(argv[i+1], &_replayTo)) {
+            i++;
+        }
+        else if(0 == strcmp(argv[i], "--format") && i+1 < argc && -1 != parseRecordFormat(argv[i+1])) {
+            _baseConfig.outputFormat = parseRecordFormat(argv[++i]);
+        }
+        else if(0 == strcmp(argv[i], "--windows") && i+1 < argc && 0 == parseStatWindows(argv[i+1], &_baseConfig)) {
+            i++;
+        }
+        else if(0 == strncmp(argv[i], "--", 2) || positionalCount == 2) {
+            printHelp();
+            exit(1);
+        }
+        else {
+            positional[positionalCount++] = argv[i];
+        }
+    }
+
+    // Replaying a recording takes no pin number, and benchmarking neither a pin nor an outfile.
+    if(NULL != _benchFilename)
+    {
+        if(0 != positionalCount || NULL != _replayFilename || NULL != _recordFilename) {
+            printHelp();
+            exit(1);
+        }
+        return;
+    }
+    int pinCount = NULL != _replayFilename ? 0 : 1;
+    if(pinCount + 1 != positionalCount || (NULL != _replayFilename && NULL != _recordFilename)) {
+        printHelp();
+        exit(1);
+    }
+    if(pinCount) {
+        _pinNum = atoi(positional[0]);
     }
-    _pinNum = atoi(argv[1]);
-    _outfilename = argv[2];
+    snprintf(_baseConfig.outfilename, sizeof(_baseConfig.outfilename), "%s", positional[pinCount]);
 }
 
 void printHelp()
 {
     printf("piook: Raspberry Pi On-Off Keying Decoder for CliMET 433MHz weather station.\n");
     printf("Usage:\n");
-    printf("  piook pinNumber outfile\n");
+    printf("  piook [--profile] [--quality] [--soft] [--adaptive-jitter] [--fold-noise] [--near-miss] [--format csv|text|json|influx|binary] [--windows list] [--config file] [--state file] [--record file] [--flight-recorder dir]\n");
+    printf("        pinNumber outfile\n");
+    printf("  piook --replay file [--from time] [--to time] [options] outfile\n");
+    printf("  piook --bench file [options]\n");
     printf("\n");
     printf("pinNumber: GPIO pin number (wiringPi number scheme) to listen on. Based on the wiringPi 'simplified' pin numbering scheme (see defined at http://wiringpi.com/pins/)\n");
     printf("outfile: filename to write data to.\n");
+    printf("--profile: report the share of CPU time used by each pipeline stage, and edges/s and readings/s, to stderr every %d seconds.\n", __profileIntervalSec);
+    printf("--quality: append signal quality figures to each record: temp,RH,meanDev,maxDev,minMargin,noiseEdges,softBits\n");
+    printf("           (pulse deviations from nominal width and margin to the timing windows in microseconds).\n");
+    printf("--soft: recover frames with a single bad bit by flipping the least confident bit when the checksum fails.\n");
+    printf("--adaptive-jitter: adapt the timing windows' jitter allowance to the measured scheduling latency, between\n");
+    printf("                   jitter_min_us and jitter_max_us (default %u-%u).\n", __jitterMinMu, __jitterMaxMu);
+    printf("--fold-noise: queue each run of noise pulses as one noise span rather than edge by edge, so that noise floods take\n");
+    printf("              far less of the capture ring and the decoder's time.\n");
+    printf("--near-miss: append frames rejected for their length or checksum, with every pulse duration and its margin to the\n");
+    printf("             timing windows, to outfile.nearmiss as binary records (rate limited; see README.md).\n");
+    printf("--format: output record format; csv (temp,RH; the default for a file), text (the default for stdout),\n");
+    printf("          json (one object per line), influx (InfluxDB line protocol) or binary (a fixed-size piook_record,\n");
+    printf("          see libpiook.h).\n");
+    printf("--windows: append rolling min, max, mean and rate of change (per hour) of each sensor's temperature and RH\n");
+    printf("           over up to 3 trailing windows to each record, e.g. --windows 10m,1h,24h.\n");
+    printf("--config: file of 'key = value' settings, overriding the command line; reloaded on SIGHUP without interrupting capture.\n");
+    printf("          Keys: on_us, off_short_us, off_long_us, jitter_us, adaptive_jitter, jitter_min_us, jitter_max_us,\n");
+    printf("          glitch_filter_us, fold_noise, near_miss, quality, soft, format, outfile, stats_windows, rule,\n");
+    printf("          aggregate_interval, aggregate_deadband, sink_policy, sink_queue, alert_sink_policy, alert_sink_queue,\n");
+    printf("          aggregate_sink_policy, aggregate_sink_queue.\n");
+    printf("          rule = name sensor|* field </<=/>/>= value [clear value] [for duration], or name sensor|* stale duration;\n");
+    printf("          field is temp, rh, or temp_/rh_ mean_ or rate_ and a stats window, e.g. temp_rate_1h. Alerts are\n");
+    printf("          appended to outfile.alerts.\n");
+    printf("--state: snapshot file for sensor state, last readings and the adapted jitter window; saved every %d minutes and at\n", __snapshotIntervalSec / 60);
+    printf("         shutdown, and loaded at startup so that the last reading is published immediately.\n");
+    printf("--record: record the edges seen by the decoder to a seekable, block compressed archive (replaced at startup).\n");
+    printf("--flight-recorder: keep the last edges in memory and, when a frame is rejected for its length or checksum or a\n");
+    printf("                   sensor misses a transmission, write the %d seconds around it to dir as a recording.\n", (int)((__flightPreNs + __flightPostNs) / 1000000000ULL));
+    printf("--replay: decode a recording offline instead of listening on a pin; sink_policy may be 'block'.\n");
+    printf("--from, --to: replay only the edges between two times; either absolute, as Unix seconds (1792274833, or\n");
+    printf("              negative for before 1970) or local time (2026-10-17T03:12[:SS]), or an offset from the start of\n");
+    printf("              the recording, '+' and a duration in seconds or with a unit (+90, +90s, +15m, +2h, +1d).\n");
+    printf("--bench: time each decode stage on its own, and the whole decode chain, over the edges of a recording.\n");
     printf("\n");
     printf(" * Must be called with root privileges.\n\n");
     printf(" * piook will listen on the specified pin for valid OOK sequences from the cliMET weather station.\n\n");
@@ -1,14 +1,480 @@
-
-#include <wiringPi.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include "decoder.h"
+
+extern decoderConfig* _publishedConfig;
+extern decoderConfig* _decoderConfig;
+
+int validateConfig(const decoderConfig* c);
+int loadConfigFile(const char* filename, decoderConfig* c);
+const unsigned int __maxConfigMu = 65535;              // Upper limit of the config file's durations (micros).
+const unsigned int __maxAggregateIntervalSec = 86400;
+decoderConfig* buildConfig();
+extern int _reloadRequested;
+void serviceConfigReload();
+void decoderConfigCheckpoint();
 
 void parseOptions(int argc, char *argv[]);
 void printHelp();
 
+int runEventLoop(const sigset_t* sigs);
+void beginShutdown();
+extern int _decoderDoneFd;
+extern int _decoderShutdown;
+void printProfile(FILE* f);
+
+void initPipelines();
 void handleInterrupt();
-int decodePulse(int highLow, unsigned int duration);
-int scanForPreamble();
+void captureEdge(unsigned int time, int highLow, uint64_t captureNs);
+void captureEdgeBatch(edgeBatch& b);
+void* pollCaptureThread(void* arg);
+void* decoderThread(void* arg);
+
+int writeFileAtomic(const char* filename, const char* buf, int len);
+int appendFile(const char* filename, const char* buf, int len);
+
+int64_t captureUnixNs(uint64_t captureNs);
+void publishReading(const decoderConfig* c, const reading& r, const frameQuality* quality);
+
+// Hot path allocation checking (debug builds with -DPIOOK_ALLOC_CHECK).
+#ifdef PIOOK_ALLOC_CHECK
+extern __thread int _tlsInHotPath;
+void armAllocCheck();
+#define HOT_PATH_ENTER() (_tlsInHotPath = 1)
+#define HOT_PATH_EXIT() (_tlsInHotPath = 0)
+#define ALLOC_CHECK_WARMED_UP() armAllocCheck()
+#else
+#define HOT_PATH_ENTER() do {} while(0)
+#define HOT_PATH_EXIT() do {} while(0)
+#define ALLOC_CHECK_WARMED_UP() do {} while(0)
+#endif
+
+// Reject/drop counters (see statBlock); the thread local block of each thread, registered on first use.
+extern __thread statBlock* _tlsStats;
+
+statBlock* allocStatBlock();
+statBlock* registerStatBlock();
+void statsSnapshot(uint64_t* counts);
+void printStats(FILE* f);
+
+// Single writer per block, so a relaxed load/store pair suffices (no locked RMW on the hot path).
+inline void statInc(statId id)
+{
+    statBlock* b = _tlsStats;
+    if(NULL == b) {
+        b = registerStatBlock();
+    }
+    __atomic_store_n(&b->counts[id], b->counts[id] + 1, __ATOMIC_RELAXED);
+}
+
+inline void statAdd(statId id, uint64_t n)
+{
+    statBlock* b = _tlsStats;
+    if(NULL == b) {
+        b = registerStatBlock();
+    }
+    __atomic_store_n(&b->counts[id], b->counts[id] + n, __ATOMIC_RELAXED);
+}
+
+extern sem_t _edgeRingSem;
+void pushEdge(const edgeEvent& edge);
+void pushEdges(const edgeBatch& b);
+void decodeEdges(const edgeEvent* edges, int n);
+
+// Per-stage latency histograms.
+enum histId {
+    HIST_CAPTURE_TO_DEQUEUE,
+    HIST_FRAME_TO_VALIDATED,
+    HIST_VALIDATED_TO_SINK,
+    HIST_WAKE_LATENCY,          // Timer wake-up lateness of a thread at the ISR thread's priority (adaptive_jitter).
+    HIST_COUNT
+};
+
+const int __histSubBits = 4;
+const int __histSubBuckets = 1 << __histSubBits;
+const int __histBucketCount = (64 - __histSubBits + 1) * __histSubBuckets;
+
+struct latencyHist {
+    uint64_t counts[__histBucketCount];
+    uint64_t max;
+};
+
+int histBucketIndex(uint64_t value);
+uint64_t histBucketUpperValue(int idx);
+void histRecord(histId id, uint64_t valueNs);
+void histSnapshot(histId id, latencyHist* out);
+uint64_t histPercentile(const latencyHist* h, uint64_t total, double pct);
+void printHistograms(FILE* f);
+
+// Capture sources (see setCaptureMode).
+enum captureMode {
+    CAPTURE_IRQ,
+    CAPTURE_POLL,
+    CAPTURE_SWITCHING
+};
+
+extern int _captureMode;
+
+// Health watchdog.
+enum healthFlag {
+    HEALTH_SENSOR_SILENT = 1 << 0,
+    HEALTH_PIN_DEAD = 1 << 1,
+    HEALTH_STORM = 1 << 2
+};
+const int HEALTH_FLAG_COUNT = 3;
+
+const int __sensorIntervalSec = 60;         // The CM7-TX transmits approx. every minute.
+
+struct sensorState {
+    int id;
+    int tempInt;            // Last reading; temperature in tenths of a degree C.
+    int rh;
+    uint64_t lastHeardNs;
+};
+
+extern sensorState _sensors[];
+extern int _sensorCount;
+
+// Rolling statistics state per sensor (see the Rolling statistics section of piook.c).
+const int __rollingSamples = 2048;          // Readings kept per sensor (about 34 hours at one a minute).
+
+// Ring positions of the readings that are candidates for a window's min or max, oldest first.
+struct monoDeque {
+    uint16_t pos[__rollingSamples];
+    int head;
+    int count;
+};
+
+struct rollingWindow {
+    uint32_t first;                         // Sequence number of the oldest reading in the window.
+    int64_t tempSum;
+    int64_t rhSum;
+    monoDeque tempMin, tempMax, rhMin, rhMax;
+};
+
+struct sensorHistory {
+    uint32_t next;                          // Sequence number of the next reading.
+    uint64_t timeNs[__rollingSamples];
+    int16_t temp[__rollingSamples];
+    int16_t rh[__rollingSamples];
+    int windowCount;
+    unsigned int windowSec[__maxStatWindows];
+    rollingWindow windows[__maxStatWindows];
+};
+
+int parseDuration(const char* s, char** end, unsigned long* sec);
+int parseStatWindows(const char* value, decoderConfig* c);
+void updateRollingStats(int sensor, const decoderConfig* c, const reading& r, rollingSummary* out);
+
+int parseRule(const char* value, decoderConfig* c);
+const char* rulesError(const decoderConfig* c);
+int rulesChanged(const decoderConfig* a, const decoderConfig* b);
+void resetReadingRules();
+void evaluateRules(const decoderConfig* c, int sensor, const reading& r);
+void staleRulesTick(const decoderConfig* c, uint64_t nowNs);
+void writeAlert(const reading& r);
+
+void aggregateReading(const decoderConfig* c, int sensor, const reading& r);
+void aggregateTick(const decoderConfig* c, int flush);
+void writeAggregate(const reading& r);
+int noteSensorHeard(int id, int tempInt, int rh, uint64_t nowNs);
+int setCaptureMode(int mode);
+void completeCaptureSwitch();
+extern int _captureSwitchFd;
+int setPinEdge(const char* edge);
+void reinitCaptureLine();
+void applyGlitchFilter();
+void applyNoiseFolding();
+void setStormMitigation(int level);
+void reportHealth(int flags);
+void watchdogTick();
+
+int publishConfig(decoderConfig* c);
+void* jitterProbeThread(void* arg);
+void noteFrameDeviation(int maxDevMu);
+void jitterTick(const decoderConfig* c);
+
+// Sink queues. Readings are queued from the decoder thread to a thread per sink; when a queue is full
+// its policy decides what gives.
+enum sinkPolicy {
+    SINK_DROP_OLDEST,
+    SINK_DROP_NEWEST,
+    SINK_COALESCE,          // Replace a queued reading from the same sensor, else drop the oldest.
+    SINK_BLOCK,             // Wait for space (offline decoding only; never blocks live capture).
+    SINK_POLICY_COUNT
+};
+
+enum sinkCounter {
+    SINK_ENQUEUED,
+    SINK_WRITTEN,
+    SINK_DROPPED_OLDEST,
+    SINK_DROPPED_NEWEST,
+    SINK_COALESCED,
+    SINK_BLOCKED,
+    SINK_MAX_DEPTH,
+    SINK_COUNTER_COUNT
+};
+
+const int __sinkQueueMax = 64;
+const int __maxSinks = 4;
+extern const char* __sinkPolicyNames[SINK_POLICY_COUNT];
+
+struct sinkQueue {
+    const char* name;
+    void (*write)(const reading& r);
+    reading items[__sinkQueueMax];
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    pthread_t thread;
+    decoderConfig* cfgInUse;    // Config the sink thread is using, else NULL (see acquireSinkConfig()).
+    uint64_t counters[SINK_COUNTER_COUNT];
+};
+
+int parseSinkPolicy(const char* name);
+int startSink(sinkQueue* q, const char* name, void (*write)(const reading& r));
+void sinkEnqueue(sinkQueue* q, const reading& r, int policy, int capacity);
+void* sinkThread(void* arg);
+void closeSink(sinkQueue* q);
+decoderConfig* acquireSinkConfig(sinkQueue* q);
+void releaseSinkConfig(sinkQueue* q);
+int sinksUsingConfig(const decoderConfig* c);
+void printSinkStats(FILE* f);
+void writeOutputReading(const reading& r);
+extern sinkQueue _outputSink;
+extern sinkQueue _alertSink;
+extern sinkQueue _aggregateSink;
+
+// Warm start state snapshot file layout (version 1). Native byte order, naturally aligned, fixed size.
+struct snapshotHeader {
+    char magic[8];              // "PIOOKSNP"
+    uint32_t version;
+    uint32_t byteOrder;         // 0x01020304 as written by the saving host.
+    uint32_t size;              // sizeof(snapshotFile)
+    uint32_t checksum;          // FNV-1a of everything after the header.
+    int64_t savedAtUnix;
+};
+
+// Only what was learned; the configured durations come from the command line and config file.
+struct snapshotCalibration {
+    uint32_t adaptedJitterMu;   // The --adaptive-jitter window, 0 if it has not been adapted.
+    uint32_t reserved[3];
+};
+
+struct snapshotSensor {
+    int32_t id;
+    int32_t tempInt;
+    int32_t rh;
+    int32_t reserved;
+    int64_t lastHeardUnix;
+};
+
+const int __maxSensors = 16;
+
+struct snapshotFile {
+    snapshotHeader header;
+    snapshotCalibration calibration;
+    uint32_t sensorCount;
+    uint32_t reserved;
+    snapshotSensor sensors[__maxSensors];
+};
+
+const int __snapshotIntervalSec = 300;
+extern char* _stateFilename;
+extern unsigned int _adaptedJitterMu;
+uint32_t snapshotChecksum(const uint8_t* buf, size_t len);
+int saveSnapshot(const char* filename);
+int loadSnapshot(const char* filename);
+void publishLastReading();
+
+// Edge archive file layout (version 1); see the Edge archive section of piook.c. Native byte order, naturally
+// aligned. An archiveHeader, then the blocks (each an archiveBlockHeader and its encoded edges), then the index
+// (an archiveIndexEntry per block) and an archiveTrailer. A recording cut short has no index; readers rebuild it
+// from the block headers.
+const int __archiveBlockEdges = 4096;
+const int __archiveMaxEdgeBytes = 7;                // Varint of (delta << 2 | span << 1 | level), then span edges.
+const int __archiveMaxBlockBytes = __archiveBlockEdges * __archiveMaxEdgeBytes;
+const uint64_t __archiveBlockMaxNs = 10000000000ULL;   // Blocks are closed after this long, whatever their size.
+const int __archiveQueueBlocks = 4;
+
+struct archiveHeader {
+    char magic[8];              // "PIOOKARC"
+    uint32_t version;
+    uint32_t byteOrder;         // 0x01020304 as written by the recording host.
+    int64_t startUnixNs;        // Wall clock and monotonic time at the start of the recording, to map
+    uint64_t startMonoNs;       // edge capture times onto wall clock times.
+};
+
+struct archiveBlockHeader {
+    uint32_t magic;             // __archiveBlockMagic.
+    uint32_t edgeCount;
+    uint32_t dataLen;           // Encoded edge bytes following the header.
+    uint32_t checksum;          // FNV-1a of the encoded edges.
+    uint64_t firstNs;           // Capture times (monotonic) of the first and last edges.
+    uint64_t lastNs;
+    uint32_t firstMu;           // wiringPi micros() of the first edge; edges are stored as deltas from it.
+    uint32_t reserved;
+};
+
+struct archiveBlock {
+    archiveBlockHeader header;
+    uint8_t data[__archiveMaxBlockBytes];
+};
+
+struct archiveIndexEntry {
+    uint64_t firstNs;
+    uint64_t offset;            // File offset of the block header.
+};
+
+struct archiveTrailer {
+    uint64_t indexOffset;
+    uint32_t blockCount;
+    uint32_t magic;             // __archiveIndexMagic.
+};
+
+// Recording side. Edges are encoded into the current block on the decoder thread; full blocks are queued
+// for a writer thread, and dropped (and counted) if it falls behind.
+struct edgeArchive {
+    int fd;
+    archiveHeader header;
+    uint32_t lastMu;                            // Encoder state (decoder thread).
+    archiveBlock blocks[__archiveQueueBlocks];  // Queued blocks from head, then the block being filled.
+    int head;
+    int count;
+    int fill;                                   // Block being filled (decoder thread).
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_t thread;
+    archiveIndexEntry* index;                   // Writer thread.
+    uint32_t indexCount;
+    uint32_t indexCap;
+    uint64_t offset;
+    uint64_t edges;
+    uint64_t blocksWritten;
+    uint64_t blocksDropped;
+};
+
+// Reading side.
+struct archiveReader {
+    int fd;
+    archiveHeader header;
+    archiveIndexEntry* index;
+    uint32_t blockCount;
+};
+
+// A --from/--to time.
+struct replayTime {
+    int set;
+    int fromStart;              // ns is an offset from the start of the recording, else a Unix time.
+    int64_t ns;
+};
+
+extern char* _recordFilename;
+extern char* _replayFilename;
+extern edgeArchive _recording;
+int openRecording(edgeArchive* a, const char* filename);
+void recordEdge(edgeArchive* a, const edgeEvent& e);
+void closeRecording(edgeArchive* a);
+void* archiveWriterThread(void* arg);
+void printArchiveStats(FILE* f);
+int openArchive(const char* filename, archiveReader* r);
+void closeArchive(archiveReader* r);
+uint32_t archiveSeek(const archiveReader* r, uint64_t monoNs);
+int readArchiveBlock(const archiveReader* r, uint32_t block, archiveBlock* out);
+int decodeArchiveBlock(const archiveBlock* b, edgeEvent* out);
+int parseReplayTime(const char* s, replayTime* t);
+int replayArchive(const char* filename, const replayTime* from, const replayTime* to);
+int replayMain();
+extern int64_t _replayClockOffsetNs;
+
+// Stage benchmarks (see the Stage benchmarks section of piook.c).
+const uint64_t __benchMinNs = 200000000ULL;        // Minimum time per stage.
+const int __benchMaxFrames = 4096;                  // Candidate frames kept as input (the rest are not timed).
+extern char* _benchFilename;
+int benchMain();
+
+// Flight recorder (see the Flight recorder section of piook.c).
+const int __flightEdges = 65536;                    // Edges kept in memory; a power of two.
+const uint64_t __flightPreNs = 30000000000ULL;      // Dumped before and after the trigger.
+const uint64_t __flightPostNs = 2000000000ULL;
+const int __flightMinIntervalSec = 60;              // Between dumps.
+
+enum flightReason {
+    FLIGHT_NONE,
+    FLIGHT_BAD_LENGTH,
+    FLIGHT_BAD_CRC,
+    FLIGHT_SENSOR_SILENT,
+    FLIGHT_REASON_COUNT
+};
+
+// A dump queued for the flight recorder's dump thread.
+struct flightRequest {
+    int reason;
+    uint64_t triggerNs;
+    unsigned int end;                               // Ring index after the window's last edge.
+};
+
+extern char* _flightDir;
+extern uint64_t _flightDumpsDropped;
+extern statBlock* _decoderStats;
+int writeArchiveFile(const char* filename, const edgeEvent* edges, int n);
+int startFlightRecorder();
+void flightRecordEdge(const edgeEvent& e);
+void flightRecorderTick(uint64_t nowNs);
+void closeFlightRecorder();
+void* flightDumpThread(void* arg);
+
+// Near-miss log (see the Near-miss log section of piook.c). Each record is a nearMissHeader followed by
+// pulseCount nearMissPulse entries, size bytes in all, in native (little endian) byte order.
+const uint32_t __nearMissMagic = 0x524D4E50u;      // "PNMR" in little endian byte order.
+const int __nearMissVersion = 1;
+const int __nearMissSlots = 16;                     // Records queued for the event loop.
+const int __nearMissBurst = 20;                     // Rate limit; records logged back to back, then
+const int __nearMissIntervalSec = 30;               // one per interval.
+
+enum nearMissReason {
+    NEAR_MISS_BAD_LENGTH = 1,
+    NEAR_MISS_BAD_CRC = 2
+};
+
+struct nearMissHeader {
+    uint32_t magic;             // __nearMissMagic.
+    uint16_t version;           // __nearMissVersion.
+    uint16_t size;              // Header and pulses.
+    int64_t unixNs;             // Wall clock time of the edge that completed the frame.
+    uint64_t frameEndNs;        // Monotonic capture time of that edge.
+    uint8_t reason;             // NEAR_MISS_*.
+    uint8_t pulseCount;         // Bits from the start of the preamble; an 'on' and an 'off' pulse each.
+    uint8_t dataLen;            // Whole bytes following the first 4 bits of the preamble (5 for a CM7-TX frame).
+    uint8_t softDecode;         // Soft decoding was tried (and failed to recover the frame).
+    uint16_t onMu;              // Timing settings the pulses were classified with.
+    uint16_t offShortMu;
+    uint16_t offLongMu;
+    uint16_t jitterMu;
+    uint16_t noiseBefore;       // Noise edges seen shortly before the frame.
+    uint16_t reserved;
+    uint8_t bits[16];           // The bits, MSB first; 1 for a short 'off' pulse.
+    uint8_t data[16];           // The bytes as received (dataLen of them).
+};
+
+struct nearMissPulse {
+    uint16_t onMu;              // Pulse durations.
+    uint16_t offMu;
+    int16_t onMarginMu;         // Distance from each duration to the nearest edge of its timing window.
+    int16_t offMarginMu;
+};
+
+struct nearMissRecord {
+    nearMissHeader header;
+    nearMissPulse pulses[__maxBits];
+};
 
-void processSequence(int preambleIdx);
-void printHex(uint8_t* buf, int len);
-uint8_t crc8( uint8_t *addr, uint8_t len);
+void logNearMiss(const decoderConfig* c, const frameBits& f, int reason, const uint8_t* data, int dataLen);
+void nearMissTick(const decoderConfig* c);
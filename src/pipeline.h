@@ -0,0 +1,796 @@
+
+// Requires decoder.h to be included first.
+#include <new>
+#include <string.h>
+
+/*===========================================================
+Statically composed decode pipeline.
+The pipeline is a chain of stage templates, each parameterised on the stage that follows it and
+holding it by value, e.g.
+
+    glitchFilter<noiseFolder<edgeRingWriter> >                            (capture thread)
+    pulseClassifier<protocolBank<frameValidator<frameParser<readingSink> > > >  (decoder thread)
+
+(the daemon's pipelines; their terminal stages, edgeRingWriter and readingSink, are in piook.c).
+
+Each stage passes its output to the next with a direct (non-virtual) call, so the compiler can
+inline the whole chain into one loop per configuration; a custom pipeline (an extra filter, a
+different sink) costs no more than writing the equivalent code by hand. A stage can be
+instantiated on its own in front of nullStage, for testing or benchmarking in isolation (see the
+Stage benchmarks section of piook.c, --bench).
+
+Stage interface (a stage implements the calls for the data it accepts):
+    onEdge(const edgeEvent& e)                      Raw edges, or noise spans (see noiseFolder).
+    onEdgeBatch(edgeBatch& b)                       Raw edges in bulk (library, replay, the decoder thread
+                                                    and polling capture). A stage may change a batch, but
+                                                    only its first b.count edges.
+    onPulse(int code, unsigned int duration, const edgeEvent& e)
+                                                    Classified pulses (see pulseClassifier).
+    onPulseBatch(const edgeBatch& b)                Classified pulses in bulk; a batch with its durations
+                                                    and codes set.
+    onFrame(const frameBits& f)                     Candidate frame; buffered bits from the preamble on
+                                                    (see protocolBank for the protocol decoders).
+    onValidFrame(const uint8_t* data, const frameQuality& q, uint64_t frameEndNs, uint64_t validatedNs)
+                                                    Frame bytes that passed the checksum.
+    onRejectedFrame(const frameBits& f, int reason, const uint8_t* data, int dataLen)
+                                                    Candidate frame rejected for its length or checksum
+                                                    (reason STAT_BAD_LENGTH or STAT_BAD_CRC).
+    onReading(const reading& r)                     Parsed reading.
+and, for every stage, forwarded down the chain:
+    setConfig(const decoderConfig* c)               Adopt a new config (only called between frames).
+    setStats(statBlock* b)                          Counter block for the stage's rejects (single writer).
+    idle()                                          True when no frame is in progress.
+    flush(uint64_t nowNs)                           Complete any frame in progress (at shutdown).
+=============================================================*/
+
+// Terminal stage that discards everything.
+struct nullStage {
+    void onEdge(const edgeEvent&) {}
+    void onEdgeBatch(edgeBatch&) {}
+    void onPulse(int, unsigned int, const edgeEvent&) {}
+    void onPulseBatch(const edgeBatch&) {}
+    void onFrame(const frameBits&) {}
+    void onValidFrame(const uint8_t*, const frameQuality&, uint64_t, uint64_t) {}
+    void onRejectedFrame(const frameBits&, int, const uint8_t*, int) {}
+    void onReading(const reading&) {}
+    void setConfig(const decoderConfig*) {}
+    void setStats(statBlock*) {}
+    bool idle() const { return true; }
+    void flush(uint64_t) {}
+};
+
+// Drops edges closer than minMu to the previous passed edge (0 = off); too short to be part of a
+// transmission, they are merged into the surrounding pulse. minMu may be changed from another thread.
+template<class Next>
+struct glitchFilter {
+    Next next;
+    statBlock* stats;
+    unsigned int minMu;
+    unsigned int lastTime;
+
+    glitchFilter() : stats(NULL), minMu(0), lastTime(0) {}
+
+    void setMinMu(unsigned int mu) { __atomic_store_n(&minMu, mu, __ATOMIC_RELAXED); }
+
+    void onEdge(const edgeEvent& e)
+    {
+        if(e.timeMu - lastTime < __atomic_load_n(&minMu, __ATOMIC_RELAXED))
+        {
+            statInc(stats, STAT_GLITCH_FILTERED);
+            return;
+        }
+        lastTime = e.timeMu;
+        next.onEdge(e);
+    }
+
+    // As above; the batch is compacted in place.
+    void onEdgeBatch(edgeBatch& b)
+    {
+        unsigned int min = __atomic_load_n(&minMu, __ATOMIC_RELAXED);
+        if(0 == min)
+        {
+            if(0 != b.count) {
+                lastTime = b.timeMu[b.count - 1];
+            }
+            next.onEdgeBatch(b);
+            return;
+        }
+
+        int n = 0;
+        for(int i=0; i<b.count; i++)
+        {
+            if(b.timeMu[i] - lastTime < min)
+            {
+                statInc(stats, STAT_GLITCH_FILTERED);
+                continue;
+            }
+            lastTime = b.timeMu[i];
+            b.captureNs[n] = b.captureNs[i];
+            b.timeMu[n] = b.timeMu[i];
+            b.level[n] = b.level[i];
+            n++;
+        }
+        b.count = n;
+        next.onEdgeBatch(b);
+    }
+
+    void setConfig(const decoderConfig* c) { next.setConfig(c); }
+    void setStats(statBlock* b) { stats = b; next.setStats(b); }
+    bool idle() const { return next.idle(); }
+    void flush(uint64_t nowNs) { next.flush(nowNs); }
+};
+
+// Classifies each edge's preceding pulse by its duration:
+// 1 - short 'off' pulse. Represents a binary 1.
+// 2 - long 'off' pulse. Represents a binary 0.
+// 3 - 'on' pulse.
+// 0 - Represents a 'noise' pulse.
+template<class Next>
+struct pulseClassifier {
+    Next next;
+    const decoderConfig* cfg;
+    unsigned int lastTime;
+
+    pulseClassifier() : cfg(NULL), lastTime(0) {}
+
+    void onEdge(const edgeEvent& e)
+    {
+        if(0 != e.spanEdges)
+        {   // A run of noise pulses, already classified by the noiseFolder.
+            lastTime = e.timeMu;
+            PIOOK_PROBE4(pulse_classified, e.captureNs, e.spanMu, e.highLow, 0);
+            next.onPulse(0, e.spanMu, e);
+            return;
+        }
+
+        // Calc duration since last interrupt.
+        // TODO: Get high precision interrupt time? (i.e. recorded with the actual interrupt)
+        unsigned int duration = e.timeMu - lastTime;
+        lastTime = e.timeMu;
+
+        int code = decodePulse(cfg, e.highLow, duration);
+        PIOOK_PROBE4(pulse_classified, e.captureNs, duration, e.highLow, code);
+        next.onPulse(code, duration, e);
+    }
+
+    // As above, classifying the whole batch at once (see classifyPulseBatch()). Batches hold plain edges only.
+    void onEdgeBatch(edgeBatch& b)
+    {
+        if(0 == b.count) {
+            return;
+        }
+        b.duration[0] = b.timeMu[0] - lastTime;
+        for(int i=1; i<b.count; i++) {
+            b.duration[i] = b.timeMu[i] - b.timeMu[i-1];
+        }
+        lastTime = b.timeMu[b.count-1];
+        classifyPulseBatch(cfg, b.duration, b.level, b.count, b.codes);
+#ifdef PIOOK_HAVE_SDT
+        for(int i=0; i<b.count; i++) {
+            PIOOK_PROBE4(pulse_classified, b.captureNs[i], b.duration[i], b.level[i], batchCode(b.codes, i));
+        }
+#endif
+        next.onPulseBatch(b);
+    }
+
+    void setConfig(const decoderConfig* c) { cfg = c; next.setConfig(c); }
+    void setStats(statBlock* b) { next.setStats(b); }
+    bool idle() const { return next.idle(); }
+    void flush(uint64_t nowNs) { next.flush(nowNs); }
+};
+
+/*===========================================================
+Protocol decoders.
+A protocol decoder is written as a resumable function (a protothread): the framing logic reads as
+straight line code that awaits one pulse at a time, rather than as a hand written state machine.
+The function is a loop that takes pulses from a pulse source (a single pulse, or the pulses of a
+batch) and re-enters the protothread with each; CO_AWAIT_PULSE() records the resume point and goes
+back for the next pulse, so a whole batch is decoded in one call. The function returns when the
+source is exhausted, or with a completed frame, in which case the next call continues from the
+following pulse. As with any protothread, locals do not survive an await; keep state in the struct.
+
+The protocolBank stage owns the classified pulse stream and resumes every registered decoder with
+each pulse, or each batch. The decoders' state lives in a pool inside the bank, allocated once by
+spawn(), so a switch between decoders is one indirect call and nothing is allocated while decoding.
+=============================================================*/
+#define CO_BEGIN(co) switch((co)->resumeLine) { case 0:
+#define CO_AWAIT_PULSE(co) do { (co)->resumeLine = __LINE__; goto coAwaitPulse; case __LINE__:; } while(0)
+#define CO_END(co) } (co)->resumeLine = 0; coAwaitPulse:
+#define CO_RESTART(co) ((co)->resumeLine = 0)
+
+// A classified pulse as passed to protocol decoders.
+struct pulseEvent {
+    int code;                   // See pulseClassifier.
+    unsigned int duration;
+    edgeEvent edge;             // The edge that ended the pulse.
+};
+
+// Pulse sources; next() takes the next pulse, returning false once there are none left. takeBits() takes
+// a run of up to max whole bits of the usual form (an 'on' pulse then a short or long 'off' pulse), for
+// decoders to buffer in bulk rather than a pulse at a time, and returns the number taken; a source that
+// cannot look ahead takes none.
+struct singlePulse {
+    const pulseEvent* p;
+
+    bool next(pulseEvent& out)
+    {
+        if(NULL == p) {
+            return false;
+        }
+        out = *p;
+        p = NULL;
+        return true;
+    }
+
+    int takeBits(int*, unsigned int*, unsigned int*, int) { return 0; }
+};
+
+struct batchPulses {
+    const edgeBatch* b;
+    int i;
+
+    bool next(pulseEvent& out)
+    {
+        if(i >= b->count) {
+            return false;
+        }
+        out.code = batchCode(b->codes, i);
+        out.duration = b->duration[i];
+        out.edge.captureNs = b->captureNs[i];
+        out.edge.timeMu = b->timeMu[i];
+        out.edge.highLow = b->level[i];
+        out.edge.spanMu = 0;
+        out.edge.spanEdges = 0;
+        i++;
+        return true;
+    }
+
+    // Whole bits are found 13 at a time from a word of codes, a bit being a pair of pulses (a nibble) that
+    // is an 'on' code (3) then a short or long 'off' code (1 or 2). Assumes a little endian host.
+    int takeBits(int* bits, unsigned int* onDur, unsigned int* offDur, int max)
+    {
+        int n = 0;
+        while(n < max && i + 1 < b->count)
+        {
+            uint64_t w;
+            memcpy(&w, b->codes + (i >> 2), sizeof(w));
+            w >>= (i & 3) * 2;
+            uint64_t whole = w & (w >> 1) & ((w >> 2) ^ (w >> 3)) & 0x1111111111111ULL;
+            int run = __builtin_ctzll((~whole & 0x1111111111111ULL) | (1ULL << 52)) / 4;
+            int limit = max - n < (b->count - i) / 2 ? max - n : (b->count - i) / 2;
+            int take = run < limit ? run : limit;
+            for(int k=0; k<take; k++)
+            {
+                bits[n + k] = (int)((w >> (4 * k + 2)) & 3);
+                onDur[n + k] = b->duration[i + 2 * k];
+                offDur[n + k] = b->duration[i + 2 * k + 1];
+            }
+            n += take;
+            i += 2 * take;
+            if(take < 13) {
+                break;
+            }
+        }
+        return n;
+    }
+};
+
+// State common to all protocol decoders. A decoder derives from this and implements
+//    template<class Src> const frameBits* resume(Src& src)
+//                                                      Decode the pulses from src (see above); returns a
+//                                                      completed candidate frame, else NULL.
+//    const frameBits* flush(uint64_t nowNs)           Complete any frame in progress.
+struct protocolDecoder {
+    int resumeLine;             // Resume point (CO_* macros); 0 = start.
+    int busy;                   // A frame is in progress.
+    statBlock* stats;
+    const decoderConfig* cfg;
+};
+
+const int __maxProtocols = 4;
+const int __protocolPoolBytes = 8192;
+
+template<class Next>
+struct protocolBank {
+    Next next;
+
+    struct slot {
+        protocolDecoder* decoder;
+        const frameBits* (*resume)(protocolDecoder* d, singlePulse& src);
+        const frameBits* (*resumeBatch)(protocolDecoder* d, batchPulses& src);
+        const frameBits* (*flush)(protocolDecoder* d, uint64_t nowNs);
+    };
+    slot slots[__maxProtocols];
+    int slotCount;
+    unsigned char pool[__protocolPoolBytes] __attribute__((aligned(64)));
+    int poolUsed;
+    statBlock* stats;
+    const decoderConfig* cfg;
+
+    protocolBank() : slotCount(0), poolUsed(0), stats(NULL), cfg(NULL) {}
+
+    template<class P, class Src>
+    static const frameBits* resumeThunk(protocolDecoder* d, Src& src) { return static_cast<P*>(d)->resume(src); }
+    template<class P>
+    static const frameBits* flushThunk(protocolDecoder* d, uint64_t nowNs) { return static_cast<P*>(d)->flush(nowNs); }
+
+    // Add a decoder, constructed in the bank's pool. Returns NULL if the pool or slots are exhausted.
+    template<class P>
+    P* spawn()
+    {
+        int size = (sizeof(P) + 63) & ~63;
+        if(slotCount >= __maxProtocols || poolUsed + size > __protocolPoolBytes) {
+            return NULL;
+        }
+        P* d = new (pool + poolUsed) P();
+        poolUsed += size;
+        d->resumeLine = 0;
+        d->busy = 0;
+        d->stats = stats;
+        d->cfg = cfg;
+
+        slot& s = slots[slotCount++];
+        s.decoder = d;
+        s.resume = &resumeThunk<P, singlePulse>;
+        s.resumeBatch = &resumeThunk<P, batchPulses>;
+        s.flush = &flushThunk<P>;
+        return d;
+    }
+
+    void onPulse(int code, unsigned int duration, const edgeEvent& e)
+    {
+        pulseEvent p;
+        p.code = code;
+        p.duration = duration;
+        p.edge = e;
+        for(int i=0; i<slotCount; i++)
+        {
+            singlePulse src;
+            src.p = &p;
+            const frameBits* f = slots[i].resume(slots[i].decoder, src);
+            if(NULL != f) {
+                next.onFrame(*f);
+            }
+        }
+    }
+
+    // As above, one call per decoder for the whole batch (plus one per frame it completes). Frames from
+    // different decoders are passed on decoder by decoder rather than in pulse order.
+    void onPulseBatch(const edgeBatch& b)
+    {
+        for(int i=0; i<slotCount; i++)
+        {
+            batchPulses src;
+            src.b = &b;
+            src.i = 0;
+            while(src.i < b.count)
+            {
+                const frameBits* f = slots[i].resumeBatch(slots[i].decoder, src);
+                if(NULL != f) {
+                    next.onFrame(*f);
+                }
+            }
+        }
+    }
+
+    void flush(uint64_t nowNs)
+    {
+        for(int i=0; i<slotCount; i++)
+        {
+            const frameBits* f = slots[i].flush(slots[i].decoder, nowNs);
+            if(NULL != f) {
+                next.onFrame(*f);
+            }
+        }
+    }
+
+    bool idle() const
+    {
+        for(int i=0; i<slotCount; i++)
+        {
+            if(slots[i].decoder->busy) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void setConfig(const decoderConfig* c)
+    {
+        cfg = c;
+        for(int i=0; i<slotCount; i++) {
+            slots[i].decoder->cfg = c;
+        }
+        next.setConfig(c);
+    }
+
+    void setStats(statBlock* b)
+    {
+        stats = b;
+        for(int i=0; i<slotCount; i++) {
+            slots[i].decoder->stats = b;
+        }
+        next.setStats(b);
+    }
+};
+
+// CM7-TX framing. Each bit is an 'on' pulse followed by a short (1) or long (0) 'off' pulse; the bits
+// are buffered until the noise that follows a transmission, then the buffer is scanned for the preamble.
+// ENHANCEMENT: This relies on a noise pulse to trigger attempted decoding of a received message; we should attempt decode
+// upon reception of enough bits and perhaps use a circular buffer.
+struct cm7Decoder : protocolDecoder {
+    int bitBuff[__maxBits+1];
+    int bitIdx;
+    unsigned int onDuration;        // Duration of the current bit's 'on' pulse.
+
+    // Timing trace for the buffered bits; the duration of each bit's 'off' pulse and of the 'on' pulse preceding it.
+    unsigned int offDurBuff[__maxBits+1];
+    unsigned int onDurBuff[__maxBits+1];
+
+    // Time (micros) of the first buffered bit, and the times of the most recent noise pulses. Used to
+    // count the noise edges seen shortly before a frame, a measure of how marginal the reception is.
+    unsigned int frameStartMu;
+    unsigned int noiseTimes[__noiseHistory];
+    unsigned int noiseCount;
+
+    frameBits frame;                // The candidate frame passed on.
+
+    cm7Decoder() : bitIdx(0), onDuration(0), frameStartMu(0), noiseCount(0) {}
+
+    template<class Src>
+    const frameBits* resume(Src& src)
+    {
+        pulseEvent p;
+        while(src.next(p))
+        {
+            if(0 == p.code)
+            {   // Noise detected; one pulse, or a noise span of several. A span's edges alternate in level,
+                // ending with the span's own.
+                unsigned int edges = 0 != p.edge.spanEdges ? p.edge.spanEdges : 1;
+                statAdd(stats, p.edge.highLow ? STAT_NOISE_ON : STAT_NOISE_OFF, (edges + 1) / 2);
+                statAdd(stats, p.edge.highLow ? STAT_NOISE_OFF : STAT_NOISE_ON, edges / 2);
+
+                // If we have buffered data then now is a good time to dump it.
+                const frameBits* f = 0 != bitIdx ? flush(p.edge.captureNs) : NULL;
+
+                // Record the noise edges (after processing the frame they terminated, which they are not 'before').
+                // A span's edge times are not kept, so they are spread evenly over the span.
+                unsigned int recorded = edges < (unsigned int)__noiseHistory ? edges : __noiseHistory;
+                for(unsigned int i=recorded; i>1; i--) {
+                    noiseTimes[noiseCount++ % __noiseHistory] = p.edge.timeMu - (unsigned int)((uint64_t)p.edge.spanMu * (i - 1) / edges);
+                }
+                noiseTimes[noiseCount++ % __noiseHistory] = p.edge.timeMu;   // The last edge (or the only one) is the span's own.
+                CO_RESTART(this);
+                if(NULL != f) {
+                    return f;
+                }
+                continue;
+            }
+
+            CO_BEGIN(this);
+            for(;;)
+            {
+                // All recorded 'off' pulses must be preceded by an 'on' pulse.
+                while(3 != p.code)
+                {
+                    statInc(stats, STAT_OFF_WITHOUT_ON);
+                    CO_AWAIT_PULSE(this);
+                }
+                onDuration = p.duration;
+                CO_AWAIT_PULSE(this);
+
+                // 'On' pulse followed by another is not really possible, but if it does
+                // occur then just ignore and wait for an 'off' pulse.
+                while(3 == p.code)
+                {
+                    statInc(stats, STAT_ON_FOLLOWED_BY_ON);
+                    CO_AWAIT_PULSE(this);
+                }
+
+                // 'Off' pulse received.
+                if(bitIdx >= __maxBits)
+                {   // Pulse train is longer than expected. Reset buffer.
+                    statInc(stats, STAT_BUFFER_OVERFLOW);
+                    bitIdx = 0;
+                }
+
+                // Buffer received bit.
+                if(0 == bitIdx) {
+                    frameStartMu = p.edge.timeMu;
+                }
+                onDurBuff[bitIdx] = onDuration;
+                offDurBuff[bitIdx] = p.duration;
+                bitBuff[bitIdx++] = p.code;
+                busy = 1;
+
+                // Buffer any whole bits that follow in bulk (from a batch), up to a full buffer; what
+                // breaks the run (noise, a stray pulse, the end of the batch) is left to the code above.
+                bitIdx += src.takeBits(bitBuff + bitIdx, onDurBuff + bitIdx, offDurBuff + bitIdx, __maxBits - bitIdx);
+                CO_AWAIT_PULSE(this);
+            }
+            CO_END(this);
+        }
+        return NULL;
+    }
+
+    // Attempt to decode the buffered bits as a frame that ended at the given time.
+    const frameBits* flush(uint64_t frameEndNs)
+    {
+        if(0 == bitIdx) {
+            return NULL;
+        }
+        int bitCount = bitIdx;
+        bitIdx = 0;
+        busy = 0;
+        CO_RESTART(this);
+
+        profSwitch(PROF_PREAMBLE);
+        int preambleIdx = scanForPreamble(bitBuff, bitCount);
+        if(-1 == preambleIdx)
+        {
+            statInc(stats, STAT_NO_PREAMBLE);
+            PIOOK_PROBE3(frame_rejected, frameEndNs, STAT_NO_PREAMBLE, bitCount);
+            return NULL;
+        }
+
+        PIOOK_PROBE3(preamble_found, frameEndNs, preambleIdx, bitCount);
+        frame.bits = bitBuff + preambleIdx;
+        frame.onDur = onDurBuff + preambleIdx;
+        frame.offDur = offDurBuff + preambleIdx;
+        frame.count = bitCount - preambleIdx;
+        frame.noiseBefore = countNoiseBefore();
+        frame.frameEndNs = frameEndNs;
+        return &frame;
+    }
+
+    // Count noise edges within the lookback period before the first buffered bit.
+    int countNoiseBefore() const
+    {
+        int count = 0;
+        unsigned int n = noiseCount < (unsigned int)__noiseHistory ? noiseCount : __noiseHistory;
+        for(unsigned int i=0; i<n; i++)
+        {
+            unsigned int t = noiseTimes[(noiseCount - 1 - i) % __noiseHistory];
+            if(frameStartMu - t > __noiseLookbackMu) {
+                break;
+            }
+            count++;
+        }
+        return count;
+    }
+};
+
+// Converts a candidate frame to bytes and validates its length and checksum (with optional soft decoding).
+template<class Next>
+struct frameValidator {
+    Next next;
+    const decoderConfig* cfg;
+    statBlock* stats;
+    bool stampFrames;           // Read the clock for each valid frame's validatedNs; else it is 0.
+
+    frameValidator() : cfg(NULL), stats(NULL), stampFrames(true) {}
+
+    void onFrame(const frameBits& f)
+    {
+        // Convert the buffered bits (following the first 4 bits of the preamble) into a byte array.
+        profSwitch(PROF_FRAME_BUILD);
+        int bitLen = f.count - 4;
+        int dataLen = bitLen / 8;
+        // Fixed size (not a VLA sized from the received bit count) so that the stack use is constant.
+        uint8_t data[__maxBits / 8];
+        bitsToBytes(f.bits + 4, dataLen, data);
+
+        // For debugging only.
+        //printHex(data, dataLen);
+
+        // Validation.
+        if(5 != dataLen)
+        {   // Reject.
+            statInc(stats, STAT_BAD_LENGTH);
+            PIOOK_PROBE3(frame_rejected, f.frameEndNs, STAT_BAD_LENGTH, bitLen);
+            next.onRejectedFrame(f, STAT_BAD_LENGTH, data, dataLen);
+            return;
+        }
+
+        frameQuality quality;
+        measureFrameQuality(cfg, f, &quality);
+        PIOOK_PROBE4(frame_quality, f.frameEndNs, packQuality(&quality), f.offDur, f.count);
+
+        // Calc checksum.
+        profSwitch(PROF_CRC);
+        uint8_t checksum = crc8(data, 4);
+        if(checksum != data[4] && cfg->softDecode && softCorrectFrame(cfg, f, data))
+        {   // Recovered a single bit error.
+            quality.softBits = 1;
+            statInc(stats, STAT_SOFT_RECOVERED);
+            checksum = data[4];
+        }
+        if(checksum != data[4])
+        {   // Reject.
+            statInc(stats, STAT_BAD_CRC);
+            PIOOK_PROBE3(frame_rejected, f.frameEndNs, STAT_BAD_CRC, bitLen);
+            next.onRejectedFrame(f, STAT_BAD_CRC, data, dataLen);
+            return;
+        }
+        statInc(stats, STAT_FRAMES_OK);
+        uint64_t validatedNs = stampFrames ? monotonicNs() : 0;
+        PIOOK_PROBE3(frame_validated, f.frameEndNs, validatedNs, packFrame(data));
+        next.onValidFrame(data, quality, f.frameEndNs, validatedNs);
+    }
+
+    void setConfig(const decoderConfig* c) { cfg = c; next.setConfig(c); }
+    void setStats(statBlock* b) { stats = b; next.setStats(b); }
+    bool idle() const { return next.idle(); }
+    void flush(uint64_t nowNs) { next.flush(nowNs); }
+};
+
+// Parses the fields of a valid CM7-TX frame.
+template<class Next>
+struct frameParser {
+    Next next;
+
+    void onValidFrame(const uint8_t* data, const frameQuality& q, uint64_t frameEndNs, uint64_t validatedNs)
+    {
+        profSwitch(PROF_PARSE);
+        reading r;
+
+        // Temperature.
+        r.tempInt = ((data[1] & 0x07) << 8) + data[2];
+        if(data[1] & 0x08) {
+            r.tempInt *= -1;
+        }
+
+        // Relative humidity.
+        r.rh = data[3];
+
+        // Sensor ID (nibbles 3 and 4).
+        r.sensorId = ((data[0] & 0x0F) << 4) | (data[1] >> 4);
+
+        r.protocol = PIOOK_PROTOCOL_CM7;
+        r.quality = q;
+        memcpy(r.raw, data, 5);
+        r.rawLen = 5;
+        r.frameEndNs = frameEndNs;
+        r.validatedNs = validatedNs;
+        r.rolling.windowCount = 0;
+        r.alert = -1;
+        next.onReading(r);
+    }
+
+    void onRejectedFrame(const frameBits& f, int reason, const uint8_t* data, int dataLen) { next.onRejectedFrame(f, reason, data, dataLen); }
+    void setConfig(const decoderConfig* c) { next.setConfig(c); }
+    void setStats(statBlock* b) { next.setStats(b); }
+    bool idle() const { return next.idle(); }
+    void flush(uint64_t nowNs) { next.flush(nowNs); }
+};
+
+// Folds runs of noise pulses into noise spans before they are queued (fold_noise). In a noise flood
+// nearly every edge ends a noise pulse, and each would take a ring entry only to be classified as
+// noise by the decoder. The first edge of a run is passed on as is, so a frame still ends (and is
+// decoded) as promptly as before; the rest are held back and passed on as one span (see edgeEvent)
+// when the run ends or reaches __maxSpanEdges. The span's last edge starts the pulse that follows,
+// so the decoder sees the same pulses and frame boundaries from far fewer ring entries. Capture
+// cannot follow the config pointer (configs are reclaimed without regard to capture), so the folder
+// classifies with its own copy of the timing windows, set by setWindows() when a config is published.
+template<class Next>
+struct noiseFolder {
+    Next next;
+    statBlock* stats;
+    int enabled;
+    decoderConfig windows;          // Classification windows only.
+    unsigned int lastTime;
+    int inRun;                      // The last pulse was noise.
+    edgeEvent span;                 // Edges held back (span.spanEdges > 0).
+
+    noiseFolder() : stats(NULL), enabled(0), lastTime(0), inRun(0)
+    {
+        memset(&windows, 0, sizeof(windows));
+        memset(&span, 0, sizeof(span));
+    }
+
+    // Called from another thread; a classification during the update may use a mix of old and new
+    // windows, which at worst folds or passes on one pulse differently to the decoder.
+    void setWindows(const decoderConfig* c)
+    {
+        __atomic_store_n(&windows.onMuLower, c->onMuLower, __ATOMIC_RELAXED);
+        __atomic_store_n(&windows.onMuUpper, c->onMuUpper, __ATOMIC_RELAXED);
+        __atomic_store_n(&windows.offShortMuLower, c->offShortMuLower, __ATOMIC_RELAXED);
+        __atomic_store_n(&windows.offShortMuUpper, c->offShortMuUpper, __ATOMIC_RELAXED);
+        __atomic_store_n(&windows.offLongMuLower, c->offLongMuLower, __ATOMIC_RELAXED);
+        __atomic_store_n(&windows.offLongMuUpper, c->offLongMuUpper, __ATOMIC_RELAXED);
+        __atomic_store_n(&enabled, c->foldNoise, __ATOMIC_RELAXED);
+    }
+
+    void onEdge(const edgeEvent& e)
+    {
+        if(!hold(e))
+        {
+            flushSpan();
+            next.onEdge(e);
+        }
+        else if(span.spanEdges >= __maxSpanEdges) {
+            flushSpan();
+        }
+    }
+
+    // As above; the batch is compacted in place. Before a span is passed on, so are the batch's edges
+    // that precede it (as a batch of their own), keeping the edges in order.
+    void onEdgeBatch(edgeBatch& b)
+    {
+        int count = b.count;
+        int n = 0;
+        for(int i=0; i<count; i++)
+        {
+            edgeEvent e;
+            e.captureNs = b.captureNs[i];
+            e.timeMu = b.timeMu[i];
+            e.highLow = b.level[i];
+            e.spanMu = 0;
+            e.spanEdges = 0;
+            bool held = hold(e);
+            if(held ? span.spanEdges >= __maxSpanEdges : 0 != span.spanEdges)
+            {
+                b.count = n;
+                if(0 != n) {
+                    next.onEdgeBatch(b);
+                }
+                n = 0;
+                flushSpan();
+            }
+            if(!held)
+            {
+                b.captureNs[n] = e.captureNs;
+                b.timeMu[n] = e.timeMu;
+                b.level[n] = b.level[i];
+                n++;
+            }
+        }
+        b.count = n;
+        if(0 != n) {
+            next.onEdgeBatch(b);
+        }
+    }
+
+    // Classify the pulse that e ends; returns true if e is held back in the span (a noise pulse that
+    // continues a run), else false, in which case e is passed on after any span it ends.
+    bool hold(const edgeEvent& e)
+    {
+        unsigned int duration = e.timeMu - lastTime;
+        lastTime = e.timeMu;
+        if(!__atomic_load_n(&enabled, __ATOMIC_RELAXED) || 0 != decodePulse(&windows, e.highLow, duration))
+        {
+            inRun = 0;
+            return false;
+        }
+        if(!inRun)
+        {   // First noise edge of a run.
+            inRun = 1;
+            return false;
+        }
+
+        if(0 == span.spanEdges) {
+            span.spanMu = 0;
+        }
+        span.captureNs = e.captureNs;
+        span.timeMu = e.timeMu;
+        span.highLow = e.highLow;
+        span.spanMu += duration;
+        span.spanEdges++;
+        return true;
+    }
+
+    void flushSpan()
+    {
+        if(0 != span.spanEdges)
+        {
+            statAdd(stats, STAT_NOISE_FOLDED, span.spanEdges - 1);
+            next.onEdge(span);
+            span.spanEdges = 0;
+        }
+    }
+
+    void setConfig(const decoderConfig* c) { next.setConfig(c); }
+    void setStats(statBlock* b) { stats = b; next.setStats(b); }
+    bool idle() const { return next.idle(); }
+    void flush(uint64_t nowNs) { next.flush(nowNs); }
+};